@@ -0,0 +1,438 @@
+/**
+ * File: bench.cpp
+ *
+ * micro-benchmarks of the storage engine, without the network. Every
+ * benchmark runs over a grid of key counts, value sizes and threads,
+ * warms up, then repeats; the median repetition is reported.
+ */
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <iomanip>
+#include <getopt.h>
+#include <time.h>
+
+#include "kv.h"
+
+using namespace std;
+
+#define BENCHDIR "tmp___bench"
+#define HOTKEYS 64		// fit in the DB cache, the last ones written stay there
+#define VALUES 16		// distinct values written in turn
+
+
+/** one benchmark at one point of the grid **/
+
+struct Case {
+	uint64_t keys;
+	uint32_t size;
+	uint32_t threads;
+	vector<string> names, misses, values;
+	void* state;		// what the benchmark set up
+};
+
+
+/**
+ * Bench
+ *
+ * setup and teardown are not timed. run does one thread's share of
+ * the operations, every thread-th key starting from its number.
+ */
+
+class Bench {
+public:
+	virtual ~Bench() {}
+	virtual const char* name() = 0;
+	virtual bool sized() { return true; }		// value size matters
+	virtual bool threaded() { return true; }	// else run once with one thread
+	virtual void setup(Case& c) {}
+	virtual void run(Case& c, uint32_t thread) = 0;
+	virtual void teardown(Case& c) {}
+};
+
+static uint64_t now() {		// ns
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * values are neither inlined in the index nor compressed, so that a cold
+ * get of a small value reads the data file like a large one does
+ */
+static DB* openDB(bool fresh) {
+	Options options;
+
+	if (fresh) {
+		system("rm -rf " BENCHDIR);
+	}
+	options.inline_size = 0;
+	options.compress_size = 0;
+	DB* db = new DB();
+	Status s = db->open(BENCHDIR, options);
+	if (!s.ok()) {
+		cerr << s.toString() << endl;
+		exit(1);
+	}
+	return db;
+}
+
+static void fill(DB* db, Case& c) {
+	for (uint64_t i = 0; i < c.keys; ++i) {
+		db->set(c.names[i], c.values[i % VALUES]);
+	}
+}
+
+
+/** Map **/
+
+static Index makeIndex(const string& key, uint64_t i) {
+	Index index;
+	index.time_stamp = 0;
+	index.key_size = (uint32_t)key.size();
+	index.key = key;
+	index.id = 0;
+	index.offset = i * 64;
+	index.seq = i + 1;
+	index.valid = true;
+	index.inlined = false;
+	return index;
+}
+
+class MapSet : public Bench {
+public:
+	const char* name() { return "map_set"; }
+	bool sized() { return false; }
+	void setup(Case& c) { c.state = new Map(); }
+	void run(Case& c, uint32_t thread) {
+		Map* map = (Map*)c.state;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			map->set(c.names[i], makeIndex(c.names[i], i));
+		}
+	}
+	void teardown(Case& c) { delete (Map*)c.state; }
+};
+
+class MapGet : public MapSet {
+public:
+	const char* name() { return "map_get"; }
+	void setup(Case& c) {
+		MapSet::setup(c);
+		Map* map = (Map*)c.state;
+		for (uint64_t i = 0; i < c.keys; ++i) {
+			map->set(c.names[i], makeIndex(c.names[i], i));
+		}
+	}
+	void run(Case& c, uint32_t thread) {
+		Map* map = (Map*)c.state;
+		Index index;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			map->get(c.names[i], index);
+		}
+	}
+};
+
+
+/** Cache **/
+
+class CacheHit : public Bench {
+public:
+	const char* name() { return "cache_hit"; }
+	void setup(Case& c) {
+		Cache* cache = new Cache((uint32_t)c.keys);
+		for (uint64_t i = 0; i < c.keys; ++i) {
+			cache->set(c.names[i], c.values[i % VALUES]);
+		}
+		c.state = cache;
+	}
+	void run(Case& c, uint32_t thread) {
+		Cache* cache = (Cache*)c.state;
+		string value;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			cache->get(c.names[i], value);
+		}
+	}
+	void teardown(Case& c) { delete (Cache*)c.state; }
+};
+
+class CacheMiss : public CacheHit {
+public:
+	const char* name() { return "cache_miss"; }
+	void run(Case& c, uint32_t thread) {
+		Cache* cache = (Cache*)c.state;
+		string value;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			cache->get(c.misses[i], value);
+		}
+	}
+};
+
+class CacheEvict : public CacheHit {
+public:
+	const char* name() { return "cache_evict"; }
+	void setup(Case& c) { c.state = new Cache((uint32_t)(c.keys / 10 + 1)); }
+	void run(Case& c, uint32_t thread) {		// all but the first tenth evict
+		Cache* cache = (Cache*)c.state;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			cache->set(c.names[i], c.values[i % VALUES]);
+		}
+	}
+};
+
+
+/** DB **/
+
+class DBSet : public Bench {
+public:
+	const char* name() { return "db_set"; }
+	void setup(Case& c) { c.state = openDB(true); }
+	void run(Case& c, uint32_t thread) {
+		DB* db = (DB*)c.state;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			db->set(c.names[i], c.values[i % VALUES]);
+		}
+	}
+	void teardown(Case& c) {
+		delete (DB*)c.state;
+		system("rm -rf " BENCHDIR);
+	}
+};
+
+class DBGetWarm : public DBSet {
+public:
+	const char* name() { return "db_get_warm"; }
+	void setup(Case& c) {
+		DB* db = openDB(true);
+		fill(db, c);
+		c.state = db;
+	}
+	void run(Case& c, uint32_t thread) {	// the same few keys over and over, from the cache
+		DB* db = (DB*)c.state;
+		string value;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			db->get(c.names[hot(c, i)], value);
+		}
+	}
+protected:
+	static uint64_t hot(Case& c, uint64_t i) { return c.keys - 1 - i % std::min((uint64_t)HOTKEYS, c.keys); }
+};
+
+class ExecGet : public DBGetWarm {
+public:
+	const char* name() { return "exec_get"; }
+	void setup(Case& c) {		// requests as they arrive, answered from the cache
+		DBGetWarm::setup(c);
+		requests.clear();
+		for (int i = 0; i < HOTKEYS; ++i) {
+			requests.push_back("get " + c.names[hot(c, i)]);
+		}
+	}
+	void run(Case& c, uint32_t thread) {
+		DB* db = (DB*)c.state;
+		string res;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			db->tryExec(requests[i % HOTKEYS], res);
+		}
+	}
+private:
+	vector<string> requests;
+};
+
+class DBGetCold : public DBSet {
+public:
+	const char* name() { return "db_get_cold"; }
+	void setup(Case& c) {		// reopened, so nothing is cached but what the OS keeps
+		DB* db = openDB(true);
+		fill(db, c);
+		delete db;
+		c.state = openDB(false);
+	}
+	void run(Case& c, uint32_t thread) {
+		DB* db = (DB*)c.state;
+		string value;
+		for (uint64_t i = thread; i < c.keys; i += c.threads) {
+			db->get(c.names[i], value);
+		}
+	}
+};
+
+class Recover : public DBSet {
+public:
+	const char* name() { return "recover"; }
+	bool threaded() { return false; }
+	void setup(Case& c) {
+		DB* db = openDB(true);
+		fill(db, c);
+		delete db;
+		c.state = nullptr;
+	}
+	void run(Case& c, uint32_t thread) {	// open loads the index from the hint files
+		c.state = openDB(false);
+	}
+};
+
+class Merge : public DBSet {
+public:
+	const char* name() { return "merge"; }
+	bool threaded() { return false; }
+	void setup(Case& c) {		// every key written twice, half the records are garbage
+		DB* db = openDB(true);
+		fill(db, c);
+		fill(db, c);
+		c.state = db;
+	}
+	void run(Case& c, uint32_t thread) {
+		streambuf* out = cout.rdbuf(nullptr);		// merge reports the database size
+		((DB*)c.state)->merge();
+		cout.rdbuf(out);
+		cout.clear();
+	}
+};
+
+
+/** time one repetition, all threads start together **/
+
+struct Worker {
+	Bench* bench;
+	Case* c;
+	uint32_t thread;
+	atomic<bool>* go;
+};
+
+static void* work(void* arg) {
+	Worker* w = (Worker*)arg;
+	while (!w->go->load()) {
+	}
+	w->bench->run(*w->c, w->thread);
+	return nullptr;
+}
+
+static uint64_t measure(Bench* bench, Case& c) {
+	vector<pthread_t> pids(c.threads);
+	vector<Worker> workers(c.threads);
+	atomic<bool> go(false);
+	uint64_t start, end;
+
+	bench->setup(c);
+	if (c.threads == 1) {
+		start = now();
+		bench->run(c, 0);
+		end = now();
+	} else {
+		for (uint32_t t = 0; t < c.threads; ++t) {
+			workers[t] = { bench, &c, t, &go };
+			pthread_create(&pids[t], nullptr, work, &workers[t]);
+		}
+		start = now();
+		go = true;
+		for (uint32_t t = 0; t < c.threads; ++t) {
+			pthread_join(pids[t], nullptr);
+		}
+		end = now();
+	}
+	bench->teardown(c);
+	return end - start;
+}
+
+static vector<uint64_t> parseList(const char* spec) {
+	vector<uint64_t> list;
+	stringstream ss(spec);
+	string item;
+	while (getline(ss, item, ',')) {
+		uint64_t n = strtoull(item.c_str(), nullptr, 10);
+		if (n == 0) {
+			cout << "invalid list: " << spec << endl;
+			exit(1);
+		}
+		list.push_back(n);
+	}
+	return list;
+}
+
+static string randomString(uint32_t len) {
+	string res(len, 'a');
+	for (auto& ch : res) {
+		ch += rand() % 26;
+	}
+	return res;
+}
+
+
+int main(int argc, char* argv[]) {
+	vector<uint64_t> keys = { 10000, 100000 }, sizes = { 16, 1024 }, threads = { 1, 4 };
+	int reps = 3, warmup = 1, opt;
+
+	while ((opt = getopt(argc, argv, "k:v:t:r:w:")) != -1) {
+		switch (opt) {
+			case 'k':
+				keys = parseList(optarg);
+				break;
+			case 'v':
+				sizes = parseList(optarg);
+				break;
+			case 't':
+				threads = parseList(optarg);
+				break;
+			case 'r':
+				reps = max(1, atoi(optarg));
+				break;
+			case 'w':
+				warmup = max(0, atoi(optarg));
+				break;
+			default:
+				cout << "Usage: " << argv[0] << " [-k keys,...] [-v value_sizes,...] [-t threads,...] [-r reps] [-w warmup] [benchmark ...]" << endl;
+				exit(1);
+		}
+	}
+	vector<string> only(argv + optind, argv + argc);
+
+	MapSet map_set; MapGet map_get;
+	CacheHit cache_hit; CacheMiss cache_miss; CacheEvict cache_evict;
+	DBSet db_set; DBGetWarm db_get_warm; ExecGet exec_get; DBGetCold db_get_cold;
+	Recover recover; Merge merge;
+	Bench* benches[] = { &map_set, &map_get, &cache_hit, &cache_miss, &cache_evict,
+		&db_set, &db_get_warm, &exec_get, &db_get_cold, &recover, &merge };
+
+	cout << left << setw(14) << "benchmark" << right << setw(10) << "keys" << setw(8) << "size" << setw(9) << "threads"
+		 << setw(14) << "ops/s" << setw(12) << "ns/op" << endl;
+	for (Bench* bench : benches) {
+		if (!only.empty() && find(only.begin(), only.end(), bench->name()) == only.end()) {
+			continue;
+		}
+		for (uint64_t k : keys) {
+			for (size_t v = 0; v < (bench->sized() ? sizes.size() : 1); ++v) {
+				for (size_t t = 0; t < (bench->threaded() ? threads.size() : 1); ++t) {
+					Case c;
+					c.keys = k;
+					c.size = (uint32_t)sizes[v];
+					c.threads = bench->threaded() ? (uint32_t)threads[t] : 1;
+					for (uint64_t i = 0; i < k; ++i) {
+						c.names.push_back("key" + to_string(i));
+						c.misses.push_back("miss" + to_string(i));
+					}
+					for (int i = 0; i < VALUES; ++i) {
+						c.values.push_back(randomString(c.size));
+					}
+
+					vector<uint64_t> times;
+					for (int r = 0; r < warmup + reps; ++r) {
+						uint64_t ns = measure(bench, c);
+						if (r >= warmup) {
+							times.push_back(ns);
+						}
+					}
+					sort(times.begin(), times.end());
+					double ns = (double)times[times.size() / 2] / k;
+					cout << left << setw(14) << bench->name() << right << setw(10) << k << setw(8)
+						 << (bench->sized() ? to_string(c.size) : "-") << setw(9) << c.threads
+						 << setw(14) << (uint64_t)(1e9 / ns) << setw(12) << fixed << setprecision(1) << ns << endl;
+				}
+			}
+		}
+	}
+	system("rm -rf " BENCHDIR);
+
+	return 0;
+}
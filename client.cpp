@@ -41,6 +41,9 @@ int main(int argc, char* argv[]) {
     while (true) {
         int nfds = epoll_wait(epfd, events, EVENTSIZE, -1);
         for (int i = 0; i < nfds; ++i) {
+            if ((events[i].events & EPOLLOUT) && events[i].data.fd == clientfd) {
+                proc->flush();      // requests queued while the socket was full
+            }
             if (events[i].events & EPOLLIN) {
                 int sockfd = events[i].data.fd;
                 if (sockfd == 0) {      // if user inputs
@@ -94,7 +97,7 @@ void initialize(int &clientfd, int &epfd, int argc, char* argv[]) {
     epfd = epoll_create1(0);
     setnonblock(clientfd);
     setnonblock(0);
-    addfd(epfd, clientfd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+    addfd(epfd, clientfd, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT | EPOLLET);
     addfd(epfd, 0, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);     // user's input 
 }
 
@@ -0,0 +1,42 @@
+/**
+ * File: coro.cpp
+ */
+
+#include "coro.h"
+
+Readiness::Readiness() : pending(0), wanted(0), waiter(nullptr) {
+	_lock = PTHREAD_MUTEX_INITIALIZER;
+}
+
+void Readiness::notify(uint32_t events) {
+	std::coroutine_handle<> h = nullptr;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {	// let the reader or writer find out
+		events |= EPOLLIN | EPOLLOUT;
+	}
+	pthread_mutex_lock(&_lock);
+	pending |= events;
+	if (waiter && (pending & wanted)) {
+		h = waiter;
+		waiter = nullptr;
+		pending &= ~wanted;
+	}
+	pthread_mutex_unlock(&_lock);
+
+	if (h) {
+		h.resume();
+	}
+}
+
+bool Readiness::suspend(std::coroutine_handle<> h, uint32_t events) {
+	pthread_mutex_lock(&_lock);
+	if (pending & events) {		// already happened, go on
+		pending &= ~events;
+		pthread_mutex_unlock(&_lock);
+		return false;
+	}
+	waiter = h;
+	wanted = events;
+	pthread_mutex_unlock(&_lock);
+	return true;
+}
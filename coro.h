@@ -0,0 +1,133 @@
+/**
+ * File: coro.h
+ *
+ * C++20 coroutine primitives for connection handlers: a detached Task per
+ * connection, lazy Async sub-coroutines, epoll readiness to wait on and
+ * work offloaded to the execution stage
+ */
+
+#ifndef CORO_H_
+#define CORO_H_
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <utility>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "pool.h"
+
+/**
+ * Task
+ *
+ * a coroutine started at once and freed when it returns, nobody awaits it
+ */
+
+struct Task {
+	struct promise_type {
+		Task get_return_object() { return Task(); }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/**
+ * Async
+ *
+ * a coroutine producing a T, which starts when awaited and resumes its
+ * awaiter when it returns
+ */
+
+template <typename T>
+class Async {
+public:
+	struct promise_type {
+		T value;
+		std::coroutine_handle<> awaiter;
+
+		Async get_return_object() { return Async(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() { return {}; }
+		auto final_suspend() noexcept {
+			struct Resume {
+				bool await_ready() noexcept { return false; }
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+					return h.promise().awaiter;
+				}
+				void await_resume() noexcept {}
+			};
+			return Resume();
+		}
+		void return_value(T v) { value = std::move(v); }
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	Async(Async&& other) : handle(other.handle) { other.handle = nullptr; }
+	~Async() { if (handle) handle.destroy(); }
+
+	bool await_ready() { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+		handle.promise().awaiter = awaiter;
+		return handle;
+	}
+	T await_resume() { return std::move(handle.promise().value); }
+private:
+	std::coroutine_handle<promise_type> handle;
+
+	explicit Async(std::coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+/**
+ * Readiness
+ *
+ * epoll events of one fd. The epoll loop notifies them, the coroutine
+ * serving the fd waits for them. An edge seen while nobody waits is kept,
+ * so it is never lost between reading to EAGAIN and suspending.
+ */
+
+class Readiness {
+public:
+	struct Awaiter {
+		Readiness* readiness;
+		uint32_t events;
+
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> h) { return readiness->suspend(h, events); }
+		void await_resume() {}
+	};
+
+	Readiness();
+	void notify(uint32_t events);
+	Awaiter wait(uint32_t events) { return Awaiter{ this, events }; }
+private:
+	pthread_mutex_t _lock;
+	uint32_t pending, wanted;
+	std::coroutine_handle<> waiter;
+
+	bool suspend(std::coroutine_handle<> h, uint32_t events);
+};
+
+/**
+ * Offload
+ *
+ * run fn on the execution stage, the coroutine resumes there when it is done
+ */
+
+struct Offload {
+	ThreadPool* pool;
+	ThreadPool::lane_t lane;
+	std::function<void()> fn;
+
+	bool await_ready() { return false; }
+	void await_suspend(std::coroutine_handle<> h) {
+		pool->submit([this, h]() {
+			fn();
+			h.resume();
+		}, lane);
+	}
+	void await_resume() {}
+};
+
+
+#endif
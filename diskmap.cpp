@@ -0,0 +1,354 @@
+/**
+ * File: diskmap.cpp
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include "diskmap.h"
+#include "kv.h"
+
+static const uint32_t EntryFixed = sizeof(uint32_t) * 2 + sizeof(uint64_t) * 2 + sizeof(time_t);
+
+DiskMap::DiskMap(uint32_t b) : fd(-1), base(nullptr), buckets(b), primary(0), max_pages(0), next_page(0), count(0), longest(1) {}
+
+DiskMap::~DiskMap() {
+	if (base) {
+		munmap(base, MaxKeydirSize);
+	}
+	if (fd >= 0) {
+		::close(fd);
+	}
+}
+
+bool DiskMap::open(const string& path, uint32_t pages) {
+	primary = (pages + buckets - 1) / buckets * buckets;
+	max_pages = static_cast<uint32_t>(MaxKeydirSize / (PageSize + BloomSize));
+	if (primary == 0 || primary >= max_pages) {
+		return false;
+	}
+
+	if ((fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return false;
+	}
+	if (ftruncate(fd, MaxKeydirSize) != 0) {
+		return false;
+	}
+	base = (char*)mmap(nullptr, MaxKeydirSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		base = nullptr;
+		return false;
+	}
+	madvise(base, MaxKeydirSize, MADV_RANDOM);		// lookups never benefit from readahead
+
+	reset();
+	return true;
+}
+
+void DiskMap::clear() {
+	// punch the whole file, pages read back as zero
+	ftruncate(fd, 0);
+	ftruncate(fd, MaxKeydirSize);
+	reset();
+}
+
+void DiskMap::reset() {		// every bucket back to its primary pages
+	dir.assign(buckets, Bucket());
+	for (uint32_t bucketno = 0; bucketno < buckets; ++bucketno) {
+		Bucket& b = dir[bucketno];
+		b.level = 0;
+		b.split = 0;
+		b.bytes = 0;
+		for (uint32_t no = bucketno; no < primary; no += buckets) {
+			b.heads.push_back(no);
+		}
+	}
+	next_page = primary;
+	count = 0;
+	longest = 1;
+}
+
+uint64_t DiskMap::hash(const string& key) {		// FNV-1a
+	uint64_t h = 14695981039346656037ull;
+	for (auto& ch : key) {
+		h ^= (unsigned char)ch;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+uint32_t DiskMap::chain(uint32_t bucketno, uint64_t h) {
+	Bucket& b = dir[bucketno];
+	uint64_t n = (uint64_t)(primary / buckets) << b.level;
+	uint64_t i = h % n;
+	if (i < b.split) {		// split already, its entries are spread over twice the chains
+		i = h % (n << 1);
+	}
+	return b.heads[i];
+}
+
+DiskMap::Page* DiskMap::page(uint32_t no) {
+	return (Page*)(base + (uint64_t)max_pages * BloomSize + (uint64_t)no * PageSize);
+}
+
+unsigned char* DiskMap::bloom(uint32_t no) {
+	return (unsigned char*)(base + (uint64_t)no * BloomSize);
+}
+
+bool DiskMap::mayContain(uint32_t no, uint64_t h) {
+	unsigned char* b = bloom(no);
+	uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+	for (uint32_t i = 0; i < BloomProbes; ++i) {
+		uint32_t bit = (h1 + i * h2) % (BloomSize * 8);
+		if (!(b[bit / 8] & (1 << (bit % 8)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void DiskMap::addBloom(uint32_t no, uint64_t h) {
+	unsigned char* b = bloom(no);
+	uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+	for (uint32_t i = 0; i < BloomProbes; ++i) {
+		uint32_t bit = (h1 + i * h2) % (BloomSize * 8);
+		b[bit / 8] |= (1 << (bit % 8));
+	}
+}
+
+void DiskMap::rebuildBloom(uint32_t no) {
+	Page* p = page(no);
+	memset(bloom(no), 0, BloomSize);
+	for (char* e = p->data; e < p->data + p->used; ) {
+		uint32_t key_size = *(uint32_t*)e;
+		addBloom(no, hash(string(e + sizeof(uint32_t), key_size)));
+		e += EntryFixed + key_size;
+	}
+}
+
+char* DiskMap::find(Page* p, const string& key) {
+	for (char* e = p->data; e < p->data + p->used; ) {
+		uint32_t key_size = *(uint32_t*)e;
+		if (key_size == key.size() && memcmp(e + sizeof(uint32_t), key.c_str(), key_size) == 0) {
+			return e;
+		}
+		e += EntryFixed + key_size;
+	}
+	return nullptr;
+}
+
+uint32_t DiskMap::allocPage(Bucket& b) {
+	if (!b.spare.empty()) {
+		uint32_t no = b.spare.back();
+		b.spare.pop_back();
+		return no;
+	}
+	uint32_t no = next_page++;
+	return (no < max_pages) ? no : 0;
+}
+
+void DiskMap::grown(uint32_t length) {
+	for (uint32_t seen = longest; seen < length && !longest.compare_exchange_weak(seen, length); ) {
+	}
+}
+
+/**
+ * split the next chain of b in turn: its entries are rehashed over twice
+ * as many chains, staying or moving to a new chain at the end. The pages
+ * of the chain are reused, those left over kept for the next allocations.
+ */
+void DiskMap::splitChain(Bucket& b) {
+	uint64_t n = (uint64_t)(primary / buckets) << b.level;
+	uint32_t from = b.split;
+	std::vector<uint32_t> pages;
+	std::vector<std::string> stay, move;
+
+	for (uint32_t no = b.heads[from]; no != 0 || pages.empty(); no = page(no)->next) {
+		pages.push_back(no);
+	}
+	if (b.spare.size() + (next_page < max_pages ? max_pages - next_page : 0) < 2 * pages.size() + 2) {
+		return;		// the keydir is full, two chains packed anew may take more pages
+	}
+	for (uint32_t no : pages) {
+		Page* p = page(no);
+		for (char* e = p->data; e < p->data + p->used; e += EntryFixed + *(uint32_t*)e) {
+			uint32_t key_size = *(uint32_t*)e;
+			uint64_t h = hash(string(e + sizeof(uint32_t), key_size));
+			(h % (n << 1) == from ? stay : move).emplace_back(e, EntryFixed + key_size);
+		}
+		p->next = 0;
+		p->entries = 0;
+		p->used = 0;
+		memset(bloom(no), 0, BloomSize);
+	}
+	b.spare.insert(b.spare.end(), pages.rbegin(), pages.rend() - 1);
+
+	uint32_t to = allocPage(b);
+	b.heads.push_back(to);
+	fill(b, b.heads[from], stay);
+	fill(b, to, move);
+	if (++b.split == n) {
+		b.split = 0;
+		++b.level;
+	}
+}
+
+void DiskMap::fill(Bucket& b, uint32_t no, const std::vector<std::string>& entries) {
+	uint32_t length = 1;
+
+	for (auto& e : entries) {
+		Page* p = page(no);
+		if (p->used + e.size() > sizeof(Page::data)) {
+			p->next = allocPage(b);
+			no = p->next;
+			p = page(no);
+			++length;
+		}
+		memcpy(p->data + p->used, e.data(), e.size());
+		p->used += e.size();
+		p->entries += 1;
+		addBloom(no, hash(string(e.data() + sizeof(uint32_t), e.size() - EntryFixed)));
+	}
+	grown(length);
+}
+
+static void decode(const char* e, Index& index) {
+	index.key_size = *(uint32_t*)e;
+	e += sizeof(uint32_t);
+	index.key.assign(e, index.key_size);
+	e += index.key_size;
+	memcpy(&index.id, e, sizeof(index.id));
+	e += sizeof(index.id);
+	memcpy(&index.offset, e, sizeof(index.offset));
+	e += sizeof(index.offset);
+	memcpy(&index.seq, e, sizeof(index.seq));
+	e += sizeof(index.seq);
+	memcpy(&index.time_stamp, e, sizeof(index.time_stamp));
+	index.valid = true;
+	index.inlined = false;		// values are never kept in the disk keydir
+	index.value.clear();
+}
+
+static void encode(char* e, const Index& index) {
+	memcpy(e, &index.key_size, sizeof(uint32_t));
+	e += sizeof(uint32_t);
+	memcpy(e, index.key.c_str(), index.key_size);
+	e += index.key_size;
+	memcpy(e, &index.id, sizeof(index.id));
+	e += sizeof(index.id);
+	memcpy(e, &index.offset, sizeof(index.offset));
+	e += sizeof(index.offset);
+	memcpy(e, &index.seq, sizeof(index.seq));
+	e += sizeof(index.seq);
+	memcpy(e, &index.time_stamp, sizeof(index.time_stamp));
+}
+
+bool DiskMap::get(uint32_t bucketno, const string& key, Index& index) {
+	uint64_t h = hash(key);
+	for (uint32_t no = chain(bucketno, h); ; ) {
+		if (mayContain(no, h)) {
+			char* e = find(page(no), key);
+			if (e) {
+				decode(e, index);
+				return true;
+			}
+		}
+		if ((no = page(no)->next) == 0) {
+			return false;
+		}
+	}
+}
+
+bool DiskMap::put(uint32_t bucketno, const Index& index) {
+	uint32_t need = EntryFixed + index.key_size;
+	uint64_t h = hash(index.key);
+	uint32_t no = chain(bucketno, h), room = 0, length = 0;
+	bool has_room = false;
+
+	if (need > sizeof(Page::data)) {
+		return false;
+	}
+
+	for (uint32_t cur = no; ; ) {
+		Page* p = page(cur);
+		++length;
+		if (mayContain(cur, h)) {
+			char* e = find(p, index.key);
+			if (e) {	// entry size only depends on the key, so rewrite in place
+				encode(e, index);
+				return true;
+			}
+		}
+		if (!has_room && p->used + need <= sizeof(Page::data)) {
+			room = cur;
+			has_room = true;
+		}
+		if (p->next == 0) {
+			no = cur;
+			break;
+		}
+		cur = p->next;
+	}
+
+	Bucket& b = dir[bucketno];
+	if (!has_room) {	// chain is full, link a new page
+		if ((room = allocPage(b)) == 0) {
+			return false;
+		}
+		page(no)->next = room;
+		grown(length + 1);
+	}
+
+	Page* p = page(room);
+	encode(p->data + p->used, index);
+	p->used += need;
+	p->entries += 1;
+	addBloom(room, h);
+	++count;
+
+	b.bytes += need;
+	if (b.bytes * 100 > (uint64_t)b.heads.size() * sizeof(Page::data) * SplitPercent) {
+		splitChain(b);
+	}
+	return true;
+}
+
+bool DiskMap::erase(uint32_t bucketno, const string& key) {
+	uint64_t h = hash(key);
+	for (uint32_t no = chain(bucketno, h); ; ) {
+		Page* p = page(no);
+		if (mayContain(no, h)) {
+			char* e = find(p, key);
+			if (e) {
+				uint32_t len = EntryFixed + *(uint32_t*)e;
+				memmove(e, e + len, p->data + p->used - (e + len));
+				p->used -= len;
+				p->entries -= 1;
+				rebuildBloom(no);
+				--count;
+				dir[bucketno].bytes -= len;
+				return true;
+			}
+		}
+		if ((no = p->next) == 0) {
+			return false;
+		}
+	}
+}
+
+void DiskMap::scan(uint32_t bucketno, const std::function<void(const Index&)>& fn) {
+	Index index;
+	for (uint32_t first : dir[bucketno].heads) {
+		for (uint32_t no = first; ; ) {
+			Page* p = page(no);
+			for (char* e = p->data; e < p->data + p->used; e += EntryFixed + *(uint32_t*)e) {
+				decode(e, index);
+				fn(index);
+			}
+			if ((no = p->next) == 0) {
+				break;
+			}
+		}
+	}
+}
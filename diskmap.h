@@ -0,0 +1,98 @@
+/**
+ * File: diskmap.h
+ *
+ * Disk resident keydir, for key sets larger than memory
+ *
+ * The file is mmap'd and split into a bloom region followed by pages:
+ *
+ *   | bloom of page 0 | bloom of page 1 | ... | page 0 | page 1 | ...
+ *
+ * Each page holds packed entries (key_size | key | id | offset | seq |
+ * time_stamp) and the number of the next page of its chain. Every chain
+ * belongs to exactly one Map bucket, hence the bucket lock of Map also
+ * protects the pages. A lookup reads the small, always hot bloom region
+ * first and only touches pages whose bloom may contain the key.
+ *
+ * Each bucket grows by linear hashing: it starts with its share of the
+ * primary pages as chains, and once its entries would fill its chains to
+ * SplitPercent it splits the next chain in turn, moving about half of its
+ * entries to a new chain. Chains hold about one page each whatever the
+ * key count, so a get reads one page header and the pages its bloom
+ * matches. The chain heads of each bucket are kept in memory.
+ *
+ * Hint files stay the source of truth, the keydir is rebuilt on open.
+ */
+
+#ifndef DISKMAP_H_
+#define DISKMAP_H_
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <ctime>
+
+const uint32_t PageSize = 4096;
+const uint32_t BloomSize = 128;		// bytes of bloom filter per page
+const uint32_t BloomProbes = 4;
+const uint64_t MaxKeydirSize = 1ull << 36;	// sparse, only touched pages use disk
+const uint32_t SplitPercent = 75;		// average fill of its chains past which a bucket splits one
+
+struct Index;
+
+class DiskMap {
+public:
+	DiskMap(uint32_t buckets);
+	~DiskMap();
+	bool open(const std::string& path, uint32_t pages);
+	bool get(uint32_t bucketno, const std::string& key, Index& index);
+	bool put(uint32_t bucketno, const Index& index);
+	bool erase(uint32_t bucketno, const std::string& key);
+	void scan(uint32_t bucketno, const std::function<void(const Index&)>& fn);
+	uint64_t size() { return count; }
+	uint32_t longestChain() { return longest; }		// pages, the most any chain has had
+	void clear();
+private:
+	struct Page {
+		uint32_t next;		// next page of the chain, 0 if none
+		uint16_t entries;
+		uint16_t used;		// bytes used after the header
+		char data[PageSize - 8];
+	};
+
+	struct Bucket {		// chains of a Map bucket, guarded by its lock
+		uint32_t level;		// (primary / buckets) << level chains, then split more
+		uint32_t split;		// next chain to split
+		uint64_t bytes;		// of its entries
+		std::vector<uint32_t> heads;	// first page of every chain
+		std::vector<uint32_t> spare;	// pages left over by splits
+	};
+
+	int fd;
+	char* base;
+	uint32_t buckets;			// number of Map buckets
+	uint32_t primary;			// primary pages, a multiple of buckets
+	uint32_t max_pages;
+	std::atomic<uint32_t> next_page;
+	std::atomic<uint64_t> count;
+	std::atomic<uint32_t> longest;
+	std::vector<Bucket> dir;
+
+	void reset();
+	uint64_t hash(const std::string& key);
+	uint32_t chain(uint32_t bucketno, uint64_t h);
+	void splitChain(Bucket& b);
+	void fill(Bucket& b, uint32_t no, const std::vector<std::string>& entries);
+	void grown(uint32_t length);
+	Page* page(uint32_t no);
+	unsigned char* bloom(uint32_t no);
+	bool mayContain(uint32_t no, uint64_t h);
+	void addBloom(uint32_t no, uint64_t h);
+	void rebuildBloom(uint32_t no);
+	char* find(Page* p, const std::string& key);
+	uint32_t allocPage(Bucket& b);
+};
+
+
+#endif
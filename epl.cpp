@@ -5,10 +5,10 @@
 
 #include "epl.h"
 
-int addfd(int epfd, int fd, int mode, int flag) {
+int addfd(int epfd, int fd, int mode, int flag, uint32_t tag) {
     epoll_event ev;
     memset(&ev, 0, sizeof(ev));
-    ev.data.fd = fd;
+    ev.data.u64 = (uint64_t)tag << 32 | (uint32_t)fd;
     ev.events = flag;
 	return epoll_ctl(epfd, mode, fd, &ev);
 }
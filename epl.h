@@ -10,8 +10,9 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <cstring>
+#include <cstdint>
 
-int addfd(int epfd, int fd, int mode = EPOLL_CTL_ADD, int flag = EPOLLIN | EPOLLET);  // with a assigned mode
+int addfd(int epfd, int fd, int mode = EPOLL_CTL_ADD, int flag = EPOLLIN | EPOLLET, uint32_t tag = 0);  // tag rides in the upper half of data.u64
 
 int setnonblock(int fd);    // nonblock I/O
 
@@ -0,0 +1,63 @@
+/**
+ * File: histogram.cpp
+ */
+
+#include "histogram.h"
+#include <cmath>
+
+size_t Histogram::index(uint64_t value) {
+	if (value < (1ULL << SUBBITS)) {
+		return (size_t)value;
+	}
+	int shift = 63 - __builtin_clzll(value) - SUBBITS;
+	return ((size_t)(shift + 1) << SUBBITS) + (size_t)((value >> shift) - (1ULL << SUBBITS));
+}
+
+uint64_t Histogram::highest(size_t index) {
+	if (index < (1ULL << SUBBITS)) {
+		return index;
+	}
+	int shift = (int)(index >> SUBBITS) - 1;
+	uint64_t sub = (index & ((1ULL << SUBBITS) - 1)) + (1ULL << SUBBITS);
+	return ((sub + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value) {
+	++counts[index(value)];
+	++total;
+	sum += value;
+	lo = value < lo ? value : lo;
+	hi = value > hi ? value : hi;
+}
+
+void Histogram::merge(const Histogram& other) {
+	for (size_t i = 0; i < counts.size(); ++i) {
+		counts[i] += other.counts[i];
+	}
+	total += other.total;
+	sum += other.sum;
+	lo = other.lo < lo ? other.lo : lo;
+	hi = other.hi > hi ? other.hi : hi;
+}
+
+void Histogram::reset() {
+	counts.assign(counts.size(), 0);
+	total = sum = hi = 0;
+	lo = UINT64_MAX;
+}
+
+uint64_t Histogram::percentile(double p) const {
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)ceil(p / 100 * total), seen = 0;
+	rank = rank < 1 ? 1 : rank;
+	for (size_t i = 0; i < counts.size(); ++i) {
+		seen += counts[i];
+		if (seen >= rank) {
+			uint64_t value = highest(i);
+			return value < hi ? value : hi;
+		}
+	}
+	return hi;
+}
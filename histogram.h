@@ -0,0 +1,45 @@
+/**
+ * File: histogram.h
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#define SUBBITS 7		// 128 linear buckets per power of two, under 1% error
+
+
+/**
+ * Histogram
+ *
+ * log-linear, in the manner of HdrHistogram: values below 2^SUBBITS
+ * each get a bucket, every power of two above is split into 2^SUBBITS
+ * equal buckets. Recording is one index computation and an increment,
+ * so each thread keeps its own and they are merged at the end.
+ */
+
+class Histogram {
+public:
+	Histogram() : counts(buckets(), 0), total(0), sum(0), lo(UINT64_MAX), hi(0) {}
+	void record(uint64_t value);
+	void merge(const Histogram& other);
+	void reset();
+	uint64_t percentile(double p) const;	// p in [0, 100], highest value of its bucket
+	uint64_t count() const { return total; }
+	uint64_t min() const { return total ? lo : 0; }
+	uint64_t max() const { return hi; }
+	double mean() const { return total ? (double)sum / total : 0; }
+private:
+	std::vector<uint64_t> counts;
+	uint64_t total, sum, lo, hi;
+
+	static size_t buckets() { return (size_t)(64 - SUBBITS + 1) << SUBBITS; }
+	static size_t index(uint64_t value);
+	static uint64_t highest(size_t index);
+};
+
+
+#endif
@@ -5,16 +5,120 @@
  */
 
 #include "kv.h"
+#include "diskmap.h"
+#include "lz4.h"
+#include <charconv>
+
+/** Checksum **/
+
+struct CrcTable {
+	uint32_t t[256];
+	CrcTable() {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+			}
+			t[i] = c;
+		}
+	}
+};
+
+static uint32_t crc32(const char* buf, size_t len) {
+	static const CrcTable table;	// initialized once, thread safe since c++11
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < len; ++i) {
+		crc = table.t[(crc ^ (unsigned char)buf[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+static uint64_t monotonic() {		// ns
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/** Trace **/
+
+thread_local Trace* Trace::current = nullptr;
+
+uint64_t Trace::begin() {
+	return current ? monotonic() : 0;
+}
+
+void Trace::end(stage_t stage, uint64_t start) {
+	if (current) {
+		current->ns[stage] += monotonic() - start;
+	}
+}
+
+void Trace::add(stage_t stage, uint64_t ns) {
+	if (current) {
+		current->ns[stage] += ns;
+	}
+}
+
 
 /** Map **/
 
-Map::Map() {
+Map::Map() : pinned(0), disk(nullptr) {
 	maps.resize(BucketSize);
+	history.resize(BucketSize);
 	lockset.resize(BucketSize);
+	stripes.resize(BucketSize);
 
 	for (auto& lock : lockset) {
 		lock = PTHREAD_RWLOCK_INITIALIZER;
 	}
+	for (auto& stripe : stripes) {
+		stripe = PTHREAD_MUTEX_INITIALIZER;
+	}
+}
+
+Map::~Map() {
+	delete disk;
+}
+
+Status Map::openDisk(const string& path, uint32_t pages) {
+	Status s;
+
+	disk = new DiskMap(BucketSize);
+	if (!disk->open(path, pages)) {
+		delete disk;
+		disk = nullptr;
+		return s.IOError("Open keydir " + path + " failed, error: " + strerror(errno));
+	}
+	return s;
+}
+
+bool Map::lookup(uint32_t bucketno, const string& key, Index& index) {
+	if (disk) {
+		return disk->get(bucketno, key, index);
+	}
+	auto it = maps[bucketno].find(key);
+	if (it == maps[bucketno].end()) {
+		return false;
+	}
+	index = it->second;
+	return true;
+}
+
+bool Map::store(uint32_t bucketno, const Index& index) {
+	if (disk) {
+		return disk->put(bucketno, index);
+	}
+	maps[bucketno][index.key] = index;
+	return true;
+}
+
+bool Map::erase(uint32_t bucketno, const string& key) {
+	if (disk) {
+		return disk->erase(bucketno, key);
+	}
+	return maps[bucketno].erase(key) > 0;
 }
 
 uint32_t Map::hash(const string& key) {
@@ -31,9 +135,14 @@ Status Map::rdlock_key(const string& key) {
 	Status s;
 	uint32_t bucketno = hash(key);
 
+	if (pthread_rwlock_tryrdlock(&lockset[bucketno]) == 0) {
+		return s;
+	}
+	uint64_t start = Trace::begin();
 	if (pthread_rwlock_rdlock(&lockset[bucketno]) != 0) {
 		return s.IOError("Rdlock failed");
 	}
+	Trace::end(STAGE_INDEX_LOCK, start);
 	return s;
 }
 
@@ -41,9 +150,14 @@ Status Map::wrlock_key(const string& key) {
 	Status s;
 	uint32_t bucketno = hash(key);
 
+	if (pthread_rwlock_trywrlock(&lockset[bucketno]) == 0) {
+		return s;
+	}
+	uint64_t start = Trace::begin();
 	if (pthread_rwlock_wrlock(&lockset[bucketno]) != 0) {
 		return s.IOError("Wrlock failed");
 	}
+	Trace::end(STAGE_INDEX_LOCK, start);
 	return s;
 }
 
@@ -57,14 +171,82 @@ Status Map::unlock_key(const string& key) {
 	return s;
 }
 
+Status Map::lock_stripe(const string& key) {
+	Status s;
+
+	if (pthread_mutex_trylock(&stripes[hash(key)]) == 0) {
+		return s;
+	}
+	uint64_t start = Trace::begin();
+	if (pthread_mutex_lock(&stripes[hash(key)]) != 0) {
+		return s.IOError("Lock stripe failed");
+	}
+	Trace::end(STAGE_INDEX_LOCK, start);
+	return s;
+}
+
+Status Map::unlock_stripe(const string& key) {
+	Status s;
+
+	if (pthread_mutex_unlock(&stripes[hash(key)]) != 0) {
+		return s.IOError("Unlock stripe failed");
+	}
+	return s;
+}
+
+vector<uint32_t> Map::bucketsOf(const vector<string>& keys) {
+	vector<uint32_t> buckets;
+
+	for (auto& key : keys) {
+		buckets.push_back(hash(key));
+	}
+	// always lock in ascending order so that two callers never deadlock
+	sort(buckets.begin(), buckets.end());
+	buckets.erase(unique(buckets.begin(), buckets.end()), buckets.end());
+	return buckets;
+}
+
+Status Map::lock_stripes(const vector<string>& keys) {
+	Status s;
+
+	uint64_t start = Trace::begin();
+	for (auto& bucketno : bucketsOf(keys)) {
+		if (pthread_mutex_lock(&stripes[bucketno]) != 0) {
+			return s.IOError("Lock stripe failed");
+		}
+	}
+	Trace::end(STAGE_INDEX_LOCK, start);
+	return s;
+}
+
+Status Map::unlock_stripes(const vector<string>& keys) {
+	Status s;
+
+	for (auto& bucketno : bucketsOf(keys)) {
+		if (pthread_mutex_unlock(&stripes[bucketno]) != 0) {
+			return s.IOError("Unlock stripe failed");
+		}
+	}
+	return s;
+}
+
 bool Map::has(const string& key) {
+	Index index;
 	uint32_t bucketno = hash(key);
-	return (maps[bucketno].count(key) > 0);
+
+	rdlock_key(key);
+	bool found = lookup(bucketno, key, index);
+	unlock_key(key);
+	return found;
 }
 
 uint64_t Map::size() {
 	uint64_t total = 0;
 
+	if (disk) {
+		return disk->size();
+	}
+
 	for (auto& _map : maps) {
 		total += _map.size();
 	}
@@ -72,6 +254,10 @@ uint64_t Map::size() {
 	return total;
 }
 
+uint32_t Map::longestChain() {
+	return disk ? disk->longestChain() : 0;
+}
+
 bool Map::empty() {
 	return (size() == 0);
 }
@@ -80,15 +266,76 @@ void Map::clear() {
 	for (auto& _map : maps) {
 		_map.clear();
 	}
+	if (disk) {
+		disk->clear();
+	}
 }
 
-void Map::copyTo(unordered_map<string, Index>& _whole_index) {
-	_whole_index.clear();
-	for (auto& _map : maps) {
-		for (auto& p : _map) {
-			_whole_index.insert(p);
+void Map::retain(uint32_t bucketno, const string& key, uint64_t until) {
+	Index index;
+
+	if (pinned == 0) {
+		return;
+	}
+	if (lookup(bucketno, key, index)) {
+		history[bucketno].push_back({ index, until });
+	}
+}
+
+void Map::trim(uint64_t oldest) {
+	for (uint32_t bucketno = 0; bucketno < BucketSize; ++bucketno) {
+		pthread_rwlock_wrlock(&lockset[bucketno]);
+		auto& versions = history[bucketno];
+		versions.erase(remove_if(versions.begin(), versions.end(), [oldest](const Version& v) {
+			return v.until <= oldest;
+		}), versions.end());
+		pthread_rwlock_unlock(&lockset[bucketno]);
+	}
+}
+
+void Map::collect(uint32_t bucketno, uint64_t seq, vector<Index>& entries) {
+	entries.clear();
+	pthread_rwlock_rdlock(&lockset[bucketno]);
+	if (disk) {
+		disk->scan(bucketno, [&entries, seq](const Index& index) {
+			if (index.seq <= seq) {
+				entries.push_back(index);
+			}
+		});
+	}
+	for (auto& p : maps[bucketno]) {
+		if (p.second.seq <= seq) {
+			entries.push_back(p.second);
+		}
+	}
+	for (auto& v : history[bucketno]) {
+		if (v.index.seq <= seq && seq < v.until) {
+			entries.push_back(v.index);
+		}
+	}
+	pthread_rwlock_unlock(&lockset[bucketno]);
+}
+
+Status Map::lock_all() {
+	Status s;
+
+	for (auto& stripe : stripes) {
+		if (pthread_mutex_lock(&stripe) != 0) {
+			return s.IOError("Lock stripe failed");
+		}
+	}
+	return s;
+}
+
+Status Map::unlock_all() {
+	Status s;
+
+	for (auto& stripe : stripes) {
+		if (pthread_mutex_unlock(&stripe) != 0) {
+			return s.IOError("Unlock stripe failed");
 		}
 	}
+	return s;
 }
 
 Status Map::set(const string& key, const Index& index) {
@@ -96,7 +343,11 @@ Status Map::set(const string& key, const Index& index) {
 	uint32_t bucketno = hash(key);
 
 	wrlock_key(key);
-	maps[bucketno][key] = index;
+	retain(bucketno, key, index.seq);
+	if (!store(bucketno, index)) {
+		unlock_key(key);
+		return s.IOError("Keydir is full or key " + key + " is too long.");
+	}
 	unlock_key(key);
 	return s;
 }
@@ -106,35 +357,122 @@ Status Map::get(const string& key, Index& index) {
 	uint32_t bucketno = hash(key);
 
 	rdlock_key(key);
-	if (!has(key)) {
+	if (!lookup(bucketno, key, index)) {
 		unlock_key(key);
-		return s.IOError("Key " + key + " not found.");
+		return s.NotFound("Key not found.");	// callers name the key if they need to
+	}
+	unlock_key(key);
+	return s;
+}
+
+Status Map::get(const string& key, Index& index, uint64_t seq) {
+	Status s;
+	uint32_t bucketno = hash(key);
+
+	rdlock_key(key);
+	if (lookup(bucketno, key, index) && index.seq <= seq) {
+		unlock_key(key);
+		return s;
+	}
+	for (auto& v : history[bucketno]) {
+		if (v.index.key == key && v.index.seq <= seq && seq < v.until) {
+			index = v.index;
+			unlock_key(key);
+			return s;
+		}
 	}
-	index = maps[bucketno][key];
 	unlock_key(key);
+	return s.NotFound("Key not found.");
+}
+
+Status Map::apply(const vector<Index>& indexes) {
+	Status s;
+	vector<string> keys;
+
+	for (auto& index : indexes) {
+		keys.push_back(index.key);
+	}
+	vector<uint32_t> buckets = bucketsOf(keys);
+
+	for (auto& bucketno : buckets) {
+		pthread_rwlock_wrlock(&lockset[bucketno]);
+	}
+	for (auto& index : indexes) {
+		uint32_t bucketno = hash(index.key);
+		retain(bucketno, index.key, index.seq);
+		if (index.valid) {
+			if (!store(bucketno, index)) {
+				s = s.IOError("Keydir is full or key " + index.key + " is too long.");
+			}
+		} else {
+			erase(bucketno, index.key);
+		}
+	}
+	for (auto it = buckets.rbegin(); it != buckets.rend(); ++it) {
+		pthread_rwlock_unlock(&lockset[*it]);
+	}
 	return s;
 }
 
-Status Map::del(const string& key) {
+Status Map::del(const string& key, uint64_t seq) {
 	Status s;
 	uint32_t bucketno = hash(key);
 
 	wrlock_key(key);
-	if (!has(key)) {
+	retain(bucketno, key, seq);
+	if (!erase(bucketno, key)) {
 		unlock_key(key);
 		return s.IOError("Key " + key + " not found.");
 	}
-	maps[bucketno].erase(key);
 	unlock_key(key);
 	return s;
 }
 
 
+/** WriteBatch **/
+
+void WriteBatch::put(const string& key, const string& value) {
+	ops.push_back({ PUT, key, value });
+}
+
+void WriteBatch::del(const string& key) {
+	ops.push_back({ DEL, key, "" });
+}
+
+
+/** Iterator **/
+
+Iterator::Iterator(DB* d, const Snapshot* snapshot) : db(d), seq(snapshot->seq), bucketno(0), pos(0) {
+	db->_index.collect(bucketno, seq, entries);
+	fill();
+}
+
+void Iterator::fill() {
+	while (entries.empty() && ++bucketno < BucketSize) {
+		db->_index.collect(bucketno, seq, entries);
+	}
+}
+
+void Iterator::next() {
+	if (++pos < entries.size()) {
+		return;
+	}
+	entries.clear();
+	pos = 0;
+	fill();
+}
+
+Status Iterator::value(string& value) {
+	return db->readData(entries[pos], value);
+}
+
+
 /** Cache **/
 
 Cache::Cache(uint32_t c) {
 	_capacity = c;
 	_size = 0;
+	_hits = _misses = 0;
 	head = new Node("head", "");
 	tail = new Node("tail", "");
 	head->next = tail;
@@ -197,19 +535,29 @@ Status Cache::get(const string& key, string& value) {
 	Status s;
 
 	lock();
-	if (table.count(key)) {
-		value = table[key]->val;
-		Node *node = table[key];
+	auto it = table.find(key);
+	if (it != table.end()) {
+		Node *node = it->second;
+		value = node->val;
 		pop(node);
 		put_front(node);
+		++_hits;
 		unlock();
 		return s;
 	} else {
+		++_misses;
 		unlock();
-		return s.NotFound("key " + key + " not found in cache.");
+		return s.NotFound("Key not in cache.");
 	}
 }
 
+void Cache::counts(uint64_t& hits, uint64_t& misses) {
+	lock();
+	hits = _hits;
+	misses = _misses;
+	unlock();
+}
+
 Status Cache::del(const string& key) {
 	Status s;
 
@@ -224,7 +572,7 @@ Status Cache::del(const string& key) {
 		return s;
 	} else {
 		unlock();
-		return s.NotFound("key " + key + " not found in cache.");
+		return s.NotFound("Key not in cache.");
 	}
 }
 
@@ -315,8 +663,10 @@ bool Env::existFile(const string& name) {
  * DB
  */
 
-DB::DB() : active_id(0), hint_id(0), cache(100), lock(nullptr), env(nullptr) {
+DB::DB() : lock(nullptr), disk_waits(0), disk_wait_ns(0), merges(0), merge_moved(0), merging(false), cache(100), active_id(0), next_pending(false), hint_id(0), env(nullptr), last_seq(0), upload_seq(0) {
 	_disk_lock = PTHREAD_RWLOCK_INITIALIZER;
+	_snap_lock = PTHREAD_MUTEX_INITIALIZER;
+	_upload_lock = PTHREAD_MUTEX_INITIALIZER;
 }
 
 DB::~DB() {
@@ -325,16 +675,38 @@ DB::~DB() {
 	delete lock;
 }
 
-Status DB::open(const string& name) {
+Status DB::open(const string& name, const Options& opts) {
 	dbname = name;
+	options = opts;
 	return init();
 }
 
 Status DB::close() {
 	Status s;
 
-	if (active_ofs.is_open()) {
-		active_ofs.close();
+	pthread_mutex_lock(&_upload_lock);
+	for (auto it = uploads.begin(); it != uploads.end(); ) {	// never committed, merge reclaims the space
+		it->second.aborted = true;
+		if (it->second.writers == 0) {
+			::close(it->second.fd);
+			it = uploads.erase(it);
+		} else {
+			++it;
+		}
+	}
+	pthread_mutex_unlock(&_upload_lock);
+
+	if (next_pending) {
+		pthread_join(next_pid, nullptr);
+		next_pending = false;
+	}
+	if (next.map) {		// never used, don't leave an empty 64M file behind
+		string name = dbname + DataDirectory + "/" + DataFileName + std::to_string(next.id);
+		unmapDataFile(next, 0);
+		remove(name.c_str());
+	}
+	if (active.map) {
+		unmapDataFile(active, active_size);
 	}
 	if (hint_ofs.is_open()) {
 		hint_ofs.close();
@@ -356,6 +728,13 @@ Status DB::init() {
 		return s;
 	}
 
+	if (options.disk_index) {	// rebuilt from hint files below
+		s = _index.openDisk(dbname + KeydirFileName, options.index_pages);
+		if (!s.ok()) {
+			return s;
+		}
+	}
+
 	if (env->existFile(dbname + IndexDirectory)) {
 		s = env->getChildren(dbname + IndexDirectory, index_files);
 		if (!s.ok()) {
@@ -367,10 +746,19 @@ Status DB::init() {
 
 	hint_id = env->getMaxId(index_files, HintFileName);
 
+	// replay hint files in the order they were written
+	sort(index_files.begin(), index_files.end(), [](const string& a, const string& b) {
+		return atoi(a.c_str() + HintFileName.size()) < atoi(b.c_str() + HintFileName.size());
+	});
+
 	// load index
+	uint32_t version = HintVersion;
 	for (auto& file : index_files) {
-		s = loadIndex(file);
-		if (!s.ok()) {
+		version = HintVersion;
+		s = loadIndex(file, version);
+		if (s.IsInvalidArgument()) {	// replaying a layout we cannot read would lose keys
+			return s;
+		} else if (!s.ok()) {
 			std::cout << s.toString() << std::endl;
 		}
 	}
@@ -386,11 +774,22 @@ Status DB::init() {
 		env->createDir(dbname + DataDirectory);
 	}
 
-	s = newFileStream(active_ofs, active_id, active_size, DataDirectory, DataFileName);
+	// a crash may leave the file before the active one unsealed
+	if (active_id > 0 && env->existFile(dbname + DataDirectory + "/" + DataFileName + std::to_string(active_id - 1))) {
+		s = sealDataFile(active_id - 1);
+		if (!s.ok()) {
+			return s;
+		}
+	}
+	s = mapDataFile(active_id, MaxDataFileSize, active, active_size);
 	if (!s.ok()) {
 		return s;
 	}
-	s = newFileStream(hint_ofs, hint_id, hint_size, IndexDirectory, HintFileName);
+	prepareNext();
+	if (!index_files.empty() && version == 0) {	// never append to a file without header
+		++hint_id;
+	}
+	s = newHintFile();
 	if (!s.ok()) {
 		return s;
 	}
@@ -401,18 +800,34 @@ Status DB::init() {
 Status DB::disk_rdlock() {
 	Status s;
 
+	if (pthread_rwlock_tryrdlock(&_disk_lock) == 0) {	// the clock is only read when we wait
+		return s;
+	}
+	uint64_t start = monotonic();
 	if (pthread_rwlock_rdlock(&_disk_lock) != 0) {
 		return s.IOError("Disk rdlock failed.");
 	}
+	uint64_t waited = monotonic() - start;
+	disk_wait_ns.fetch_add(waited, memory_order_relaxed);
+	disk_waits.fetch_add(1, memory_order_relaxed);
+	Trace::add(STAGE_DISK_LOCK, waited);
 	return s;
 }
 
 Status DB::disk_wrlock() {
 	Status s;
 
+	if (pthread_rwlock_trywrlock(&_disk_lock) == 0) {
+		return s;
+	}
+	uint64_t start = monotonic();
 	if (pthread_rwlock_wrlock(&_disk_lock) != 0) {
 		return s.IOError("Disk wrlock failed.");
 	}
+	uint64_t waited = monotonic() - start;
+	disk_wait_ns.fetch_add(waited, memory_order_relaxed);
+	disk_waits.fetch_add(1, memory_order_relaxed);
+	Trace::add(STAGE_DISK_LOCK, waited);
 	return s;
 }
 
@@ -441,18 +856,73 @@ Status DB::newFileStream(ofstream& ofs, uint32_t& id, uint64_t& size, const stri
 	}
 }
 
+/**
+ * a hint file starts with
+ *
+ *   HintMagic | HintVersion | last_seq
+ *
+ * so that entries of another layout are refused instead of misread. The
+ * seq is the high water mark when the file was created: merge drops the
+ * hint files holding tombstones and overwritten records, and their seqs
+ * must still not be handed out again after a restart.
+ */
+Status DB::newHintFile() {
+	Status s = newFileStream(hint_ofs, hint_id, hint_size, IndexDirectory, HintFileName);
+
+	if (s.ok() && hint_size == 0) {
+		string header;
+		header.append((char*)&HintMagic, sizeof(HintMagic));
+		header.append((char*)&HintVersion, sizeof(HintVersion));
+		header.append((char*)&last_seq, sizeof(last_seq));
+		hint_ofs.write(header.c_str(), header.size());
+		hint_ofs.flush();
+		hint_size = header.size();
+	}
+	return s;
+}
+
 Status DB::set(const string& key, const string& value) {
 	Status s;
+	uint64_t seq;
+
+	_index.lock_stripe(key);
+	s = putRecord(key, value, seq);
+	_index.unlock_stripe(key);
+	return s;
+}
+
+Data DB::makeData(const string& key, const string& value, time_t ts) {
 	Data data;
-	Index index;
 
-	data.time_stamp = env->timeStamp();
+	data.time_stamp = ts;
 	data.key_size = static_cast<uint32_t>(key.size());
 	data.val_size = static_cast<uint32_t>(value.size());
 	data.key = key;
 	data.value = value;
 	data.crc = 0;	// NOT implement crc & magic here
 	data.magic = 0;
+	data.compressed = false;
+
+	if (options.compress_size > 0 && value.size() >= options.compress_size &&
+		(options.stream_size == 0 || value.size() < options.stream_size)) {
+		uint32_t raw = static_cast<uint32_t>(value.size());
+		string buf(sizeof(raw) + value.size(), '\0');
+		memcpy(&buf[0], &raw, sizeof(raw));
+		size_t n = lz4_compress(value.c_str(), value.size(), &buf[sizeof(raw)], value.size() - sizeof(raw));
+		if (n > 0) {	// keep it raw unless it shrinks
+			buf.resize(sizeof(raw) + n);
+			data.value.swap(buf);
+			data.val_size = static_cast<uint32_t>(data.value.size());
+			data.compressed = true;
+		}
+	}
+	return data;
+}
+
+Status DB::putRecord(const string& key, const string& value, uint64_t& seq) {
+	Status s;
+	Data data = makeData(key, value, env->timeStamp());
+	Index index;
 
 	index.time_stamp = env->timeStamp();
 	index.key_size = static_cast<uint32_t>(key.size());
@@ -460,17 +930,24 @@ Status DB::set(const string& key, const string& value) {
 
 	// write to disk
 	disk_wrlock();
+	uint64_t start = Trace::begin();
 	uint64_t off = syncData(data);
-	if (off < 0) {
+	if (off == (uint64_t)-1) {
 		disk_unlock();
 		return s.IOError("Write data failed.");
 	}
 
 	index.id = active_id;
 	index.offset = off;
+	index.seq = seq = ++last_seq;
 	index.valid = true;
+	index.inlined = inlinable(value);
+	if (index.inlined) {
+		index.value = value;
+	}
 
 	s = syncIndex(index);
+	Trace::end(STAGE_WRITE, start);
 	if (!s.ok()) {
 		disk_unlock();
 		return s;
@@ -480,486 +957,2705 @@ Status DB::set(const string& key, const string& value) {
 	// update index
 	_index.set(key, index);
 
-	// update cache
-	cache.set(key, value);
+	// update cache, inlined values don't need it
+	if (index.inlined) {
+		cache.del(key);
+	} else {
+		cache.set(key, value);
+	}
 
 	return s;
 }
 
 uint64_t DB::syncData(const Data& data) {
-	uint64_t off = active_size;
-	if (active_size < MaxDataFileSize) {	// if not full
-		active_ofs.write((char*)&data.time_stamp, sizeof(data.time_stamp));
-		active_ofs.write((char*)&data.key_size, sizeof(data.key_size));
-		active_ofs.write((char*)&data.val_size, sizeof(data.val_size));
-		active_ofs.write(data.key.c_str(), data.key_size);
-		active_ofs.write(data.value.c_str(), data.val_size);
-		active_ofs.write((char*)&data.crc, sizeof(data.crc));
-		active_ofs.write((char*)&data.magic, sizeof(data.magic));
-
-		active_size += sizeof(time_t) + sizeof(uint32_t) * 4 + data.key_size + data.val_size;
-		active_ofs.flush();
-		return off;
-	} else {
-		active_ofs.close();
+	string buf;
+	encodeData(data, buf);
+	return appendData(buf);
+}
+
+Status DB::syncIndex(const Index& index) {
+	string buf;
+	encodeIndex(index, buf);
+	return appendIndex(buf);
+}
+
+void DB::encodeData(const Data& data, string& buf) {
+	buf.append((char*)&data.time_stamp, sizeof(data.time_stamp));
+	buf.append((char*)&data.key_size, sizeof(data.key_size));
+	uint32_t val_size = data.val_size | (data.compressed ? CompressedFlag : 0);
+	buf.append((char*)&val_size, sizeof(val_size));
+	buf.append(data.key.c_str(), data.key_size);
+	buf.append(data.value.c_str(), data.val_size);
+	buf.append((char*)&data.crc, sizeof(data.crc));
+	buf.append((char*)&data.magic, sizeof(data.magic));
+}
 
-		Status s;
-		s = newFileStream(active_ofs, ++active_id, active_size, DataDirectory, DataFileName);
+void DB::encodeIndex(const Index& index, string& buf) {
+	buf.append((char*)&index.time_stamp, sizeof(index.time_stamp));
+	buf.append((char*)&index.key_size, sizeof(index.key_size));
+	buf.append(index.key.c_str(), index.key_size);
+	buf.append((char*)&index.id, sizeof(index.id));
+	buf.append((char*)&index.offset, sizeof(index.offset));
+	buf.append((char*)&index.seq, sizeof(index.seq));
+	buf.append((char*)&index.valid, sizeof(index.valid));
+
+	uint32_t inline_size = index.inlined ? static_cast<uint32_t>(index.value.size()) : NoInline;
+	buf.append((char*)&inline_size, sizeof(inline_size));
+	if (index.inlined) {
+		buf.append(index.value);
+	}
+}
+
+uint64_t DB::appendData(const string& buf) {
+	if (active_size + buf.size() > active.capacity) {		// never overshoot the file
+		Status s = rollData(buf.size());
 		if (!s.ok()) {
 			return -1;
 		}
-		return syncData(data);
 	}
+
+	uint64_t off = active_size;
+	memcpy(active.map + off, buf.c_str(), buf.size());
+	active_size += buf.size();
+	return off;
 }
 
-Status DB::syncIndex(const Index& index) {
+/**
+ * Open a data file and map capacity bytes of it, preallocating them so
+ * that appends never extend the file. end is the size of the records in
+ * it: a sealed file is exactly that long, otherwise records are scanned
+ * until the zeroed, preallocated tail.
+ */
+Status DB::mapDataFile(uint32_t id, uint64_t capacity, DataFile& file, uint64_t& end) {
 	Status s;
-	if (hint_size < MaxHintFileSize) {		// if not full
-		hint_ofs.write((char*)&index.time_stamp, sizeof(index.time_stamp));
-		hint_ofs.write((char*)&index.key_size, sizeof(index.key_size));
-		hint_ofs.write(index.key.c_str(), index.key_size);
-		hint_ofs.write((char*)&index.id, sizeof(index.id));
-		hint_ofs.write((char*)&index.offset, sizeof(index.offset));
-		hint_ofs.write((char*)&index.valid, sizeof(index.valid));
-		
-		hint_size += sizeof(time_t) + sizeof(uint32_t) * 2 + sizeof(uint64_t) + index.key_size + sizeof(bool);
-		hint_ofs.flush();
+	struct stat st;
+	string name = dbname + DataDirectory + "/" + DataFileName + std::to_string(id);
+
+	if ((file.fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0644)) < 0) {
+		return s.IOError("Open data file " + name + " failed, error: " + strerror(errno));
+	}
+	fstat(file.fd, &st);
+	capacity = std::max(capacity, (uint64_t)st.st_size);
+	if (fallocate(file.fd, 0, 0, capacity) != 0 && ftruncate(file.fd, capacity) != 0) {
+		::close(file.fd);
+		return s.IOError("Preallocate data file " + name + " failed, error: " + strerror(errno));
+	}
+	file.map = (char*)mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+	if (file.map == MAP_FAILED) {
+		file.map = nullptr;
+		::close(file.fd);
+		return s.IOError("Map data file " + name + " failed, error: " + strerror(errno));
+	}
+	file.id = id;
+	file.capacity = capacity;
+
+	if ((uint64_t)st.st_size < capacity) {
+		end = st.st_size;
 		return s;
-	} else {
-		hint_ofs.close();
+	}
 
-		s = newFileStream(hint_ofs, ++hint_id, hint_size, IndexDirectory, HintFileName);
-		if (!s.ok()) {
-			return s;
+	const uint64_t header = sizeof(time_t) + sizeof(uint32_t) * 2, trailer = sizeof(uint32_t) * 2;
+	end = 0;
+	while (end + header <= capacity) {
+		time_t ts = *(time_t*)(file.map + end);
+		uint32_t key_size = *(uint32_t*)(file.map + end + sizeof(time_t));
+		uint32_t val_size = *(uint32_t*)(file.map + end + sizeof(time_t) + sizeof(uint32_t)) & ~CompressedFlag;
+		uint64_t len = header + key_size + val_size + trailer;
+		if (ts == 0 || end + len > capacity) {		// zeroed tail
+			break;
 		}
+		end += len;
+	}
+	return s;
+}
 
-		return syncIndex(index);
+void DB::unmapDataFile(DataFile& file, uint64_t end) {
+	munmap(file.map, file.capacity);
+	if (ftruncate(file.fd, end) != 0) {		// seal, the file ends with its last record
+		std::cout << "Seal data file " << file.id << " failed" << std::endl;
 	}
+	::close(file.fd);
+	file = DataFile();
 }
 
-Status DB::get(const string& key, string& value) {
+Status DB::sealDataFile(uint32_t id) {
 	Status s;
-	Index index;
+	DataFile file;
+	uint64_t end;
+	struct stat st;
+	string name = dbname + DataDirectory + "/" + DataFileName + std::to_string(id);
 
-	// firstly search in cache
-	s = cache.get(key, value);
-	if (s.ok()) {
+	// sealing truncates a file below its preallocation, so only a full size file may need the scan
+	if (::stat(name.c_str(), &st) == 0 && (uint64_t)st.st_size < MaxDataFileSize) {
 		return s;
 	}
-
-	// if not found, search in index
-	if (_index.has(key)) {
-		_index.get(key, index);
-		uint32_t id = index.id;
-		uint64_t offset = index.offset;
-		time_t ts;
-		disk_rdlock();
-		s = retrieve(key, id, offset, ts, value);
-		disk_unlock();
-		return s;
-	} else {
-		return s.NotFound("Key " + key + " not found.");
+	s = mapDataFile(id, 0, file, end);
+	if (s.ok()) {
+		unmapDataFile(file, end);
 	}
+	return s;
 }
 
-Status DB::del(const string& key) {
-	Status s;
-	Index index;
-
-	// delete in cache
-	cache.del(key);
-
-	// delete in disk
-	if (_index.has(key)) {
-		_index.get(key, index);
-		index.time_stamp = env->timeStamp();
-		index.valid = false;
-		disk_wrlock();
-		s = syncIndex(index);
-		disk_unlock();
+void* DB::prepare(void* arg) {
+	DB* db = (DB*)arg;
+	uint64_t end;
 
-		_index.del(key);
-		return s;
-	} else {
-		return s.NotFound("Key " + key + " not found.");
+	if (!db->mapDataFile(db->next.id, MaxDataFileSize, db->next, end).ok()) {
+		db->next = DataFile();
 	}
+	return nullptr;
 }
 
-Status DB::retrieve(const string& key, const uint32_t id, const uint64_t offset, time_t& ts, string& value) {
-	Status s;
-	ifstream ifs;
-	ifs.open(dbname + DataDirectory + "/" + DataFileName + std::to_string(id), std::ios::out | std::ios::binary);
-	ifs.seekg(offset, std::ios::beg);
-
-	uint32_t key_size = 0, val_size = 0;
-	ifs.read((char*)&ts, sizeof(ts));
-	ifs.read((char*)&key_size, sizeof(key_size));
-	ifs.read((char*)&val_size, sizeof(val_size));
-
-	char *read_key = new char[key_size + 1], *read_val = new char[val_size + 1];
-	ifs.read(read_key, key_size);
-	ifs.read(read_val, val_size);
-	read_key[key_size] = '\0';
-	read_val[val_size] = '\0';
-	value = string(read_val);
-
-	delete[] read_key;
-	delete[] read_val;
-	ifs.close();
-	return s;
+void DB::prepareNext() {
+	next.id = active_id + 1;
+	next_pending = (pthread_create(&next_pid, nullptr, prepare, (void*)this) == 0);
 }
 
-Status DB::loadIndex(const string& file) {
+/**
+ * seal the active file and switch to the next one, which is normally
+ * ready already. Caller holds _disk_lock.
+ */
+Status DB::rollData(uint64_t need) {
 	Status s;
-	ifstream ifs;
-	ifs.open(dbname + IndexDirectory + "/" + file, std::ios::out | std::ios::binary);
-	ifs.seekg(0, std::ios::beg);
-	if (!ifs.is_open()) {
-		return s.IOError("open " + dbname + DataDirectory + "/" + file + " failed.");
+
+	if (next_pending) {
+		pthread_join(next_pid, nullptr);
+		next_pending = false;
 	}
+	unmapDataFile(active, active_size);
 
-	while (ifs) {
-		Index index;
-		ifs.read((char*)&index.time_stamp, sizeof(time_t));
-		if (ifs.eof()) break;
-		ifs.read((char*)&index.key_size, sizeof(index.key_size));
-		char *read_key = new char[index.key_size + 1];
-		ifs.read(read_key, index.key_size);
-		read_key[index.key_size] = '\0';
-		index.key = string(read_key);
-		delete[] read_key;
-		ifs.read((char*)&index.id, sizeof(index.id));
-		ifs.read((char*)&index.offset, sizeof(index.offset));
-		ifs.read((char*)&index.valid, sizeof(bool));
-		
-		if (index.valid) {
-			_index.set(index.key, index);
-		} else {
-			if (_index.has(index.key)) {
-				_index.del(index.key);
-			}
+	if (next.map && next.capacity >= need) {
+		active = next;
+		next = DataFile();
+		active_size = 0;
+	} else {
+		if (next.map) {		// too small for this record, grow it instead
+			unmapDataFile(next, 0);
+		}
+		s = mapDataFile(active_id + 1, std::max((uint64_t)MaxDataFileSize, need), active, active_size);
+		if (!s.ok()) {
+			return s;
 		}
 	}
+	active_id = active.id;
 
-	ifs.close();
-
+	prepareNext();
 	return s;
 }
 
-string DB::exec(const string& cmd) {
-	stringstream ss(cmd);
-	string op, k, v;
+Status DB::appendIndex(const string& buf) {
 	Status s;
+	if (hint_size < MaxHintFileSize) {		// if not full
+		hint_ofs.write(buf.c_str(), buf.size());
+		hint_size += buf.size();
+		hint_ofs.flush();
+		return s;
+	} else {
+		hint_ofs.close();
 
-	ss >> op;
-	if (op == "set") {
-		ss >> k >> v;
-		s = set(k, v);
-		if (!s.ok()) {
-			return "set failed";
-		} else {
-			return "set success";
-		}
-	} else if (op == "get") {
-		ss >> k;
-		s = get(k, v);
-		if (!s.ok()) {
-			return s.toString();
-		} else {
-			return v;
-		}
-	} else if (op == "del") {
-		ss >> k;
-		s = del(k);
+		++hint_id;
+		s = newHintFile();
 		if (!s.ok()) {
-			return s.toString();
-		} else {
-			return "del success";
+			return s;
 		}
-	} else {
-		return "invalid command";
+
+		return appendIndex(buf);
 	}
 }
 
-Status DB::merge() {
+/**
+ * All puts of a batch go to the data file in one append. The batch is
+ * committed by a single hint record:
+ *
+ *   time_stamp | BatchMarker | count | body size | crc | body
+ *
+ * where body holds the hint entries of every put and delete. loadIndex
+ * drops the whole batch if the record is torn or the crc mismatches.
+ */
+Status DB::write(WriteBatch& batch) {
 	Status s;
-	string val;
-	unordered_map<string, Index> _whole_index;
-	unordered_map<string, string> kv;	
-	vector<string> index_files, data_files;
+	string data_buf, body, record;
+	vector<Index> indexes(batch.ops.size());
+	vector<uint64_t> offsets(batch.ops.size(), 0);
+	vector<string> keys;
+	time_t ts = env->timeStamp();
 
-	_index.copyTo(_whole_index);
-	for (auto& p : _whole_index) {
-		s = get(p.first, val);
-		if (!s.ok()) {
-			return s;
-		}
-		kv[p.first] = val;
-	}
-	
-	s = env->getChildren(dbname + IndexDirectory, index_files);
-	if (!s.ok()) {
-		return s.IOError("Get children of " + dbname + IndexDirectory + " failed.");
+	if (batch.ops.empty()) {
+		return s;
 	}
-	for (auto& file : index_files) {
-		if (remove((dbname + IndexDirectory + "/" + file).c_str()) != 0) {
-			return s.IOError("Remove file " + dbname + IndexDirectory + "/" + file + " failed.");
+
+	for (size_t i = 0; i < batch.ops.size(); ++i) {
+		auto& op = batch.ops[i];
+		Index& index = indexes[i];
+
+		index.time_stamp = ts;
+		index.key_size = static_cast<uint32_t>(op.key.size());
+		index.key = op.key;
+		index.id = 0;
+		index.offset = 0;
+		index.seq = 0;
+		index.valid = (op.type == WriteBatch::PUT);
+		index.inlined = index.valid && inlinable(op.value);
+		if (index.inlined) {
+			index.value = op.value;
 		}
-	}
+		keys.push_back(op.key);
 
-	s = env->getChildren(dbname + DataDirectory, data_files);
-	if (!s.ok()) {
-		return s.IOError("Get children of " + dbname + DataDirectory + " failed.");
-	}
-	for (auto& file : data_files) {
-		if (remove((dbname + DataDirectory + "/" + file).c_str()) != 0) {
-			return s.IOError("Remove file " + dbname + DataDirectory + "/" + file + " failed.");
+		if (op.type == WriteBatch::PUT) {
+			offsets[i] = data_buf.size();
+			encodeData(makeData(op.key, op.value, ts), data_buf);
 		}
 	}
 
+	_index.lock_stripes(keys);
+	disk_wrlock();
+	uint64_t start = Trace::begin();
+	uint64_t base = 0;
+	if (!data_buf.empty()) {
+		base = appendData(data_buf);
+		if (base == (uint64_t)-1) {
+			disk_unlock();
+			_index.unlock_stripes(keys);
+			return s.IOError("Write batch data failed.");
+		}
+	}
 
-	s = newFileStream(active_ofs, active_id = 0, active_size, DataDirectory, DataFileName);
-	if (!s.ok()) {
-		return s;
+	uint64_t seq = ++last_seq;		// the whole batch shares one sequence number
+	for (size_t i = 0; i < indexes.size(); ++i) {
+		indexes[i].seq = seq;
+		if (indexes[i].valid) {
+			indexes[i].id = active_id;
+			indexes[i].offset = base + offsets[i];
+		}
+		encodeIndex(indexes[i], body);
 	}
 
-	s = newFileStream(hint_ofs, hint_id = 0, hint_size, IndexDirectory, HintFileName);
+	uint32_t marker = BatchMarker, count = static_cast<uint32_t>(indexes.size());
+	uint32_t body_size = static_cast<uint32_t>(body.size()), crc = crc32(body.c_str(), body.size());
+	record.append((char*)&ts, sizeof(ts));
+	record.append((char*)&marker, sizeof(marker));
+	record.append((char*)&count, sizeof(count));
+	record.append((char*)&body_size, sizeof(body_size));
+	record.append((char*)&crc, sizeof(crc));
+	record.append(body);
+
+	s = appendIndex(record);
+	Trace::end(STAGE_WRITE, start);
+	disk_unlock();
 	if (!s.ok()) {
+		_index.unlock_stripes(keys);
 		return s;
 	}
 
+	// update index
+	_index.apply(indexes);
 
-	_index.clear();
-	for (auto& p : kv) {
-		set(p.first, p.second);
+	// update cache
+	for (size_t i = 0; i < batch.ops.size(); ++i) {
+		auto& op = batch.ops[i];
+		if (op.type == WriteBatch::PUT && !indexes[i].inlined) {
+			cache.set(op.key, op.value);
+		} else {
+			cache.del(op.key);
+		}
 	}
-
-	std::cout << "Database size: " << _index.size() << std::endl;
+	_index.unlock_stripes(keys);
 
 	return s;
 }
 
+/**
+ * lookups inside the engine miss with a static message, the public reads
+ * name the key, paying for it only on a miss. exec skips this and names
+ * the key in its reply instead.
+ */
+static Status named(const Status& s, const string& key) {
+	Status r = s;
+	return r.IsNotFound() ? r.NotFound("Key " + key + " not found.") : r;
+}
 
+Status DB::get(const string& key, string& value) {
+	Status s;
+	Index index;
 
-/** Debugger **/
-Debugger::Debugger() {
-	srand((unsigned)time(nullptr));
+	if (memGet(key, value, index, s)) {
+		return named(s, key);
+	}
+	return readData(index, value);
 }
 
+Status DB::get(const string& key, string& value, uint64_t& version) {
+	Status s;
 
-string Debugger::genString() {
-	int len = 10 + rand() % 20;
-	string res(len, 'a');
-	for (auto& ch : res) {
-		ch += rand() % 26;
-	}
-	return res;
+	_index.lock_stripe(key);	// so that value and version match
+	s = readRecord(key, value, version);
+	_index.unlock_stripe(key);
+	return named(s, key);
 }
 
-void Debugger::test_db() {
+Status DB::get(const string& key, string& value, const Snapshot* snapshot) {
 	Status s;
+	Index index;
 
-	s = db.open("tmp___");
+	s = _index.get(key, index, snapshot->seq);
 	if (!s.ok()) {
-		cout << s.toString() << endl;
-		system("rm -rf tmp___");
-		return; 
+		return named(s, key);
 	}
+	return readData(index, value);
+}
 
-	cout << "====== Test set ======" << endl;
+Status DB::readRecord(const string& key, string& value, uint64_t& version) {
+	Status s;
+	Index index;
 
-	// generate random kv pair
-	unordered_map<string, string> kv;
-	for (int i = 0; i < 5000; ++i) {
-		string k = genString(), v = genString();
-		kv[k] = v;
-		s = db.set(k, v);
-		if (!s.ok()) {
-			cout << s.toString() << endl;
-			cout << "Set failed" << endl;
-			system("rm -rf tmp___");
-			return;
-		}
-		cout << "Case " << i << " ok" << endl;
+	if (memGet(key, value, index, s)) {
+		version = index.seq;
+		return s;
 	}
+	version = index.seq;
+	return readData(index, value);
+}
 
-	cout << "====== Set ok ======" << endl;
-
-	cout << "====== Test merge & get ======" << endl;
-	db.merge();
-	s = db.merge();
-	if (!s.ok()) {
-		cout << s.toString() << endl;
-		system("rm -rf tmp___");
-		return;
+/**
+ * answer a read from memory: a value inlined in the index, then the cache.
+ * Returns false if the value has to be read from the file index points to.
+ */
+bool DB::memGet(const string& key, string& value, Index& index, Status& s) {
+	s = _index.get(key, index);
+	if (!s.ok()) {		// the message is static, see notFound
+		return true;
 	}
-
-	for (auto& p : kv) {
-		string k = p.first, v;
-		s = db.get(k, v);
-		if (!s.ok()) {
-			cout << "Get failed" << endl;
-			system("rm -rf tmp___");
-			return;
-		}
+	if (index.inlined) {
+		value = index.value;
+		return true;
 	}
+	s = cache.get(key, value);
+	return s.ok();
+}
 
-	cout << "====== Merge & Get ok ======" << endl;
-	
-	cout << "====== Test random get ======" << endl;
+Status DB::readData(const Index& index, string& value) {
+	Status s;
+	time_t ts;
 
-	for (int i = 0; i < 1000; ++i) {
-		string k = genString(), v;
-		s = db.get(k, v);
-		if (kv.count(k) && s.IsNotFound() || !kv.count(k) && s.ok()) {
-			cout << "Random get failed" << endl;
-			system("rm -rf tmp___");
-			return;
+	if (index.inlined) {
+		value = index.value;
+		return s;
+	}
+	if (sealed(index.id)) {
+		Index moved = index;
+		s = retrieve(index.key, index.id, index.offset, ts, value);
+		if (s.IsIOError() && relocated(moved, s)) {
+			return s.ok() ? readData(moved, value) : named(s, index.key);
 		}
-		cout << "Case " << i << " ok" << endl;
+		return s;
 	}
+	disk_rdlock();
+	s = retrieve(index.key, index.id, index.offset, ts, value);
+	disk_unlock();
+	return s;
+}
 
-	cout << "====== Random get ok ======" << endl;
+/**
+ * a sealed file never changes again, so reading it needs no lock shared
+ * with the writer. active_id moves on only after the file is sealed.
+ */
+bool DB::sealed(uint32_t id) {
+	return id < active_id;
+}
 
-	cout << "====== Test del ======" << endl;
+/**
+ * merge removes an old data file as soon as its records are moved, it does
+ * not wait for reads that looked their key up before. Returns true if the
+ * file of index is gone and the key was looked up again: s tells whether
+ * it is still there, and index then points to where the record moved.
+ */
+bool DB::relocated(Index& index, Status& s) {
+	Index moved;
 
-	for (auto& p : kv) {
-		string k = p.first;
-		s = db.del(k);
-		if (!s.ok()) {
-			cout << s.toString() << endl;
-			cout << "Del failed" << endl;
-			system("rm -rf tmp___");
-			return;
-		}
+	if (!sealed(index.id) || env->existFile(dbname + DataDirectory + "/" + DataFileName + std::to_string(index.id))) {
+		return false;
 	}
+	s = _index.get(index.key, moved);
+	if (s.ok() && moved.id == index.id && moved.offset == index.offset) {	// removed by someone else
+		s = s.IOError("Data file " + std::to_string(index.id) + " is missing.");
+		return false;
+	}
+	index = moved;
+	return true;
+}
 
-	cout << "====== Del ok ======" << endl;
-
-	cout << "====== Check empty ======" << endl;
+bool DB::inlinable(const string& value) {	// the disk keydir has no room for values
+	return !options.disk_index && value.size() < options.inline_size;
+}
 
-	if (!db._index.empty()) {
-		cout << "Not empty! size: " << db._index.size() << endl;
-		system("rm -rf tmp___");
-		return;
-	}
+Status DB::del(const string& key) {
+	Status s;
 
-	cout << "====== All test pass ======" << endl;
-	system("rm -rf tmp___");
+	_index.lock_stripe(key);
+	s = delRecord(key);
+	_index.unlock_stripe(key);
+	return s;
 }
 
-void Debugger::ui() {
-	string cmd;
+Status DB::delRecord(const string& key) {
 	Status s;
-	s = db.open("tmp___");
+	Index index;
 
-	if (!s.ok()) {
-		cout << s.toString() << endl;
+	// delete in cache
+	cache.del(key);
+
+	// delete in disk
+	if (_index.has(key)) {
+		_index.get(key, index);
+		index.time_stamp = env->timeStamp();
+		index.valid = false;
+		index.inlined = false;
+		index.value.clear();
+		disk_wrlock();
+		index.seq = ++last_seq;
+		s = syncIndex(index);
+		disk_unlock();
+
+		_index.del(key, index.seq);
+		return s;
+	} else {
+		return s.NotFound("Key " + key + " not found.");
+	}
+}
+
+Status DB::incrby(const string& key, int64_t delta, int64_t& result) {
+	Status s;
+	string value;
+	uint64_t version, seq;
+	int64_t current = 0;
+
+	_index.lock_stripe(key);
+	s = readRecord(key, value, version);
+	if (s.ok()) {
+		char *end = nullptr;
+		errno = 0;
+		current = strtoll(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || errno == ERANGE) {
+			_index.unlock_stripe(key);
+			return s.InvalidArgument("Value of " + key + " is not an integer.");
+		}
+	} else if (!s.IsNotFound()) {
+		_index.unlock_stripe(key);
+		return s;
+	}
+
+	if ((delta > 0 && current > INT64_MAX - delta) || (delta < 0 && current < INT64_MIN - delta)) {
+		_index.unlock_stripe(key);
+		return s.InvalidArgument("Increment of " + key + " overflows.");
+	}
+	result = current + delta;
+	s = putRecord(key, std::to_string(result), seq);
+	_index.unlock_stripe(key);
+	return s;
+}
+
+Status DB::append(const string& key, const string& suffix, uint64_t& length) {
+	Status s;
+	string value;
+	uint64_t version, seq;
+
+	_index.lock_stripe(key);
+	s = readRecord(key, value, version);
+	if (!s.ok() && !s.IsNotFound()) {
+		_index.unlock_stripe(key);
+		return s;
+	}
+
+	value += suffix;
+	length = value.size();
+	s = putRecord(key, value, seq);
+	_index.unlock_stripe(key);
+	return s;
+}
+
+/**
+ * version 0 means the key must not exist, on conflict current is set to
+ * the version found so that the caller can retry without another get
+ */
+Status DB::cas(const string& key, uint64_t version, const string& value, uint64_t& current) {
+	Status s;
+	string old;
+
+	_index.lock_stripe(key);
+	s = readRecord(key, old, current);
+	if (s.IsNotFound()) {
+		current = 0;
+	} else if (!s.ok()) {
+		_index.unlock_stripe(key);
+		return s;
+	}
+
+	if (current != version) {
+		_index.unlock_stripe(key);
+		return s.Conflict("Version of " + key + " is " + std::to_string(current) + ".");
+	}
+	s = putRecord(key, value, current);
+	_index.unlock_stripe(key);
+	return s;
+}
+
+/**
+ * answered from the index alone while the client's copy is current,
+ * otherwise the value is read as gets would
+ */
+Status DB::getIfModified(const string& key, uint64_t version, string& value, uint64_t& current) {
+	Status s;
+	Index index;
+
+	s = _index.get(key, index);
+	if (!s.ok()) {
+		return s.NotFound("Key " + key + " not found.");
+	}
+	if (index.seq == version) {
+		value.clear();
+		current = version;
+		return s;
+	}
+	return get(key, value, current);
+}
+
+/**
+ * reserve a record for a value of size bytes in the active data file and
+ * write its header, the value is then written in place chunk by chunk
+ */
+Status DB::beginUpload(const string& key, uint64_t size, uint64_t& token) {
+	Status s;
+	Upload upload;
+	string header;
+
+	if (key.empty() || size == 0 || size >= CompressedFlag) {
+		return s.InvalidArgument("Invalid upload of " + std::to_string(size) + " bytes.");
+	}
+
+	upload.key = key;
+	upload.time_stamp = env->timeStamp();
+	upload.size = size;
+	upload.claimed = 0;
+	upload.received = 0;
+	upload.writers = 0;
+	upload.aborted = false;
+
+	uint32_t key_size = static_cast<uint32_t>(key.size()), val_size = static_cast<uint32_t>(size);
+	header.append((char*)&upload.time_stamp, sizeof(upload.time_stamp));
+	header.append((char*)&key_size, sizeof(key_size));
+	header.append((char*)&val_size, sizeof(val_size));
+	header.append(key);
+	uint64_t need = header.size() + size + sizeof(uint32_t) * 2;	// crc and magic stay zero
+
+	disk_wrlock();
+	if (active_size + need > active.capacity) {
+		s = rollData(need);
+		if (!s.ok()) {
+			disk_unlock();
+			return s;
+		}
+	}
+	string name = dbname + DataDirectory + "/" + DataFileName + std::to_string(active_id);
+	if ((upload.fd = ::open(name.c_str(), O_WRONLY)) < 0) {
+		disk_unlock();
+		return s.IOError("Open data file " + name + " failed, error: " + strerror(errno));
+	}
+	upload.id = active_id;
+	upload.offset = active_size;
+	upload.pos = active_size + header.size();
+	memcpy(active.map + active_size, header.c_str(), header.size());
+	active_size += need;
+
+	pthread_mutex_lock(&_upload_lock);
+	token = ++upload_seq;
+	uploads[token] = upload;
+	pthread_mutex_unlock(&_upload_lock);
+	disk_unlock();
+
+	return s;
+}
+
+/**
+ * write the next len bytes of an upload, committing it with the last ones.
+ * Each chunk claims the bytes after those claimed before it, so chunks of
+ * one upload written at once land in the order they got here.
+ */
+Status DB::writeChunk(uint64_t token, const char* buf, size_t len, uint64_t& received) {
+	Status s;
+	Upload done;
+
+	if (options.max_chunk && len > options.max_chunk) {
+		return s.InvalidArgument("Chunk of " + std::to_string(len) + " bytes is over the limit of " + std::to_string(options.max_chunk) + ".");
+	}
+	pthread_mutex_lock(&_upload_lock);
+	auto it = uploads.find(token);
+	if (it == uploads.end() || it->second.aborted) {
+		pthread_mutex_unlock(&_upload_lock);
+		return s.NotFound("Upload " + std::to_string(token) + " not found.");
+	}
+	Upload* upload = &it->second;		// the node stays put while it has writers
+	if (len > upload->size - upload->claimed) {
+		pthread_mutex_unlock(&_upload_lock);
+		return s.InvalidArgument("Chunk overruns upload " + std::to_string(token) + ".");
+	}
+	uint64_t at = upload->pos + upload->claimed;
+	int fd = upload->fd;
+	upload->claimed += len;
+	++upload->writers;
+	pthread_mutex_unlock(&_upload_lock);
+
+	for (size_t written = 0; written < len; ) {
+		ssize_t n = pwrite(fd, buf + written, len - written, at + written);
+		if (n <= 0) {
+			s = s.IOError("Write upload " + std::to_string(token) + " failed, error: " + strerror(errno));
+			break;
+		}
+		written += n;
+	}
+
+	pthread_mutex_lock(&_upload_lock);
+	--upload->writers;
+	if (!s.ok()) {		// a hole in the value, it can never be committed
+		upload->aborted = true;
+	} else if (!upload->aborted) {
+		upload->received += len;
+	}
+	received = upload->received;
+	bool complete = !upload->aborted && upload->received == upload->size;
+	bool aborted = upload->aborted;
+	if ((complete || aborted) && upload->writers == 0) {		// the last one out closes the fd
+		done = std::move(*upload);
+		uploads.erase(token);
+		::close(done.fd);
+	}
+	pthread_mutex_unlock(&_upload_lock);
+
+	if (!s.ok()) {
+		return s;
+	}
+	if (aborted) {
+		return s.NotFound("Upload " + std::to_string(token) + " not found.");
+	}
+	if (complete) {
+		s = commitUpload(done);
+	}
+	return s;
+}
+
+/**
+ * an upload with chunks still being written is only marked, the fd must
+ * not be closed and reused under them
+ */
+Status DB::abortUpload(uint64_t token) {
+	Status s;
+
+	pthread_mutex_lock(&_upload_lock);
+	auto it = uploads.find(token);
+	if (it == uploads.end() || it->second.aborted) {
+		pthread_mutex_unlock(&_upload_lock);
+		return s.NotFound("Upload " + std::to_string(token) + " not found.");
+	}
+	it->second.aborted = true;
+	if (it->second.writers == 0) {
+		::close(it->second.fd);
+		uploads.erase(it);
+	}
+	pthread_mutex_unlock(&_upload_lock);
+	return s;
+}
+
+bool DB::uploading(uint64_t token) {
+	pthread_mutex_lock(&_upload_lock);
+	auto it = uploads.find(token);
+	bool live = (it != uploads.end() && !it->second.aborted);
+	pthread_mutex_unlock(&_upload_lock);
+	return live;
+}
+
+Status DB::commitUpload(const Upload& upload) {
+	Status s;
+	Index index;
+
+	index.time_stamp = upload.time_stamp;
+	index.key_size = static_cast<uint32_t>(upload.key.size());
+	index.key = upload.key;
+	index.id = upload.id;
+	index.offset = upload.offset;
+	index.valid = true;
+	index.inlined = false;
+
+	_index.lock_stripe(upload.key);
+	disk_wrlock();
+	index.seq = ++last_seq;
+	s = syncIndex(index);
+	disk_unlock();
+	if (s.ok()) {
+		_index.set(upload.key, index);
+		cache.del(upload.key);		// too large to be worth caching
+	}
+	_index.unlock_stripe(upload.key);
+	return s;
+}
+
+/**
+ * read length bytes of a value from offset, touching only that part of
+ * the data file unless the record is compressed
+ */
+Status DB::getRange(const string& key, uint64_t offset, uint64_t length, string& value) {
+	Status s;
+	Index index;
+	uint64_t size;
+
+	if (options.max_chunk && length > options.max_chunk) {		// the reply is held whole
+		return s.InvalidArgument("Range of " + std::to_string(length) + " bytes is over the limit of " + std::to_string(options.max_chunk) + ".");
+	}
+	if (memGet(key, value, index, s)) {
+		if (s.ok()) {
+			value = offset < value.size() ? value.substr(offset, length) : "";
+		}
+		return named(s, key);
+	}
+	return readRange(index, offset, length, value, size);
+}
+
+Status DB::valueSize(const string& key, uint64_t& size) {
+	Status s;
+	Index index;
+	string value;
+
+	if (memGet(key, value, index, s)) {
+		size = value.size();
+		return named(s, key);
+	}
+	return readRange(index, 0, 0, value, size);
+}
+
+/**
+ * open the data file of a record and find its value: pos is where the
+ * stored bytes start and val_size is their length, compression flag included.
+ * index follows the record if merge moved it meanwhile.
+ */
+Status DB::openValue(Index& index, int& fd, uint64_t& pos, uint32_t& val_size) {
+	Status s;
+	string name = dbname + DataDirectory + "/" + DataFileName + std::to_string(index.id);
+	char header[sizeof(time_t) + sizeof(uint32_t) * 2];
+	uint32_t key_size;
+
+	if (sealed(index.id)) {		// once open, merge removing the file does no harm
+		fd = ::open(name.c_str(), O_RDONLY);
+	} else {
+		disk_rdlock();
+		fd = ::open(name.c_str(), O_RDONLY);
+		disk_unlock();
+	}
+	if (fd < 0) {
+		s = s.IOError("Open data file " + std::to_string(index.id) + " failed.");
+		if (relocated(index, s)) {
+			return s.ok() ? openValue(index, fd, pos, val_size) : named(s, index.key);
+		}
+		return s;
+	}
+	if (pread(fd, header, sizeof(header), index.offset) != (ssize_t)sizeof(header)) {
+		::close(fd);
+		fd = -1;
+		return s.IOError("Read " + index.key + " from data file " + std::to_string(index.id) + " failed.");
+	}
+	memcpy(&key_size, header + sizeof(time_t), sizeof(key_size));
+	memcpy(&val_size, header + sizeof(time_t) + sizeof(key_size), sizeof(val_size));
+	pos = index.offset + sizeof(header) + key_size;
+	return s;
+}
+
+Status DB::readRange(Index& index, uint64_t offset, uint64_t length, string& value, uint64_t& size) {
+	Status s;
+	uint64_t pos;
+	uint32_t val_size, raw;
+	int fd;
+
+	s = openValue(index, fd, pos, val_size);
+	if (!s.ok()) {
+		return s;
+	}
+
+	if (val_size & CompressedFlag) {	// the raw size leads the block
+		if (pread(fd, &raw, sizeof(raw), pos) != (ssize_t)sizeof(raw)) {
+			s = s.IOError("Read " + index.key + " from data file " + std::to_string(index.id) + " failed.");
+		} else if ((size = raw) > offset && length > 0) {
+			s = readData(index, value);
+			if (s.ok()) {
+				value = value.substr(offset, length);
+			}
+		} else {
+			value.clear();
+		}
+	} else {
+		size = val_size;
+		length = offset < size ? std::min(length, size - offset) : 0;
+		value.resize(length);
+		uint64_t start = Trace::begin();
+		if (length > 0 && pread(fd, &value[0], length, pos + offset) != (ssize_t)length) {
+			s = s.IOError("Read " + index.key + " from data file " + std::to_string(index.id) + " failed.");
+		}
+		Trace::end(STAGE_READ, start);
+	}
+	::close(fd);
+	return s;
+}
+
+Status DB::retrieve(const string& key, const uint32_t id, const uint64_t offset, time_t& ts, string& value) {
+	Status s;
+	ifstream ifs;
+	uint64_t start = Trace::begin();
+	ifs.open(dbname + DataDirectory + "/" + DataFileName + std::to_string(id), std::ios::out | std::ios::binary);
+	if (!ifs.is_open()) {
+		return s.IOError("Open data file " + std::to_string(id) + " failed.");
+	}
+	ifs.seekg(offset, std::ios::beg);
+
+	uint32_t key_size = 0, val_size = 0;
+	ifs.read((char*)&ts, sizeof(ts));
+	ifs.read((char*)&key_size, sizeof(key_size));
+	ifs.read((char*)&val_size, sizeof(val_size));
+	bool compressed = (val_size & CompressedFlag) != 0;
+	val_size &= ~CompressedFlag;
+
+	string stored(val_size, '\0');
+	ifs.seekg(key_size, std::ios::cur);
+	ifs.read(&stored[0], val_size);
+	Trace::end(STAGE_READ, start);
+	if (ifs.fail()) {
+		return s.IOError("Read " + key + " from data file " + std::to_string(id) + " failed.");
+	}
+	ifs.close();
+
+	if (!compressed) {
+		value.swap(stored);
+		return s;
+	}
+
+	uint32_t raw = 0;
+	if (stored.size() >= sizeof(raw)) {
+		memcpy(&raw, &stored[0], sizeof(raw));
+	}
+	value.assign(raw, '\0');
+	if (stored.size() < sizeof(raw) ||
+		!lz4_decompress(&stored[sizeof(raw)], stored.size() - sizeof(raw), &value[0], raw)) {
+		return s.IOError("Decompress " + key + " failed.");
+	}
+	return s;
+}
+
+Status DB::loadIndex(const string& file, uint32_t& version) {
+	Status s;
+	ifstream ifs;
+	ifs.open(dbname + IndexDirectory + "/" + file, std::ios::out | std::ios::binary);
+	ifs.seekg(0, std::ios::beg);
+	if (!ifs.is_open()) {
+		return s.IOError("open " + dbname + DataDirectory + "/" + file + " failed.");
+	}
+
+	uint32_t header[2] = { 0, 0 };
+	uint64_t seq = 0;
+	ifs.read((char*)header, sizeof(header));
+	if (ifs.gcount() < (streamsize)sizeof(header)) {	// empty, or torn before its first entry
+		ifs.close();
+		return s;
+	}
+	if (header[0] != HintMagic) {		// written before hint files had a header
+		ifs.clear();
+		ifs.seekg(0, std::ios::beg);
+		version = 0;
+		loadBaseline(ifs);
+		ifs.close();
+		return s;
+	}
+	if (header[1] != HintVersion) {
+		ifs.close();
+		return s.InvalidArgument("Hint file " + dbname + IndexDirectory + "/" + file + " is not in hint format " +
+			std::to_string(HintVersion) + ", it was written by another version of the server. Refusing to open.");
+	}
+	ifs.read((char*)&seq, sizeof(seq));
+	if (ifs.fail()) {
+		ifs.close();
+		return s;
+	}
+	last_seq = std::max(last_seq, seq);
+	version = header[1];
+
+	while (ifs) {
+		Index index;
+		ifs.read((char*)&index.time_stamp, sizeof(time_t));
+		if (ifs.eof()) break;
+		ifs.read((char*)&index.key_size, sizeof(index.key_size));
+		if (index.key_size == BatchMarker) {
+			s = loadBatch(ifs);
+			if (!s.ok()) {
+				break;		// torn tail, the batch was never committed
+			}
+			continue;
+		}
+		if (!readIndex(ifs, index)) {
+			break;
+		}
+		
+		if (index.valid) {
+			_index.set(index.key, index);
+		} else {
+			if (_index.has(index.key)) {
+				_index.del(index.key);
+			}
+		}
+	}
+
+	ifs.close();
+
+	return s;
+}
+
+/**
+ * Format 0, the hint files of the first release: no header, no batches,
+ * and entries of time_stamp | key_size | key | id | offset | valid. They
+ * carry no seq, so every entry takes the next one in replay order, which
+ * is the same on every restart until merge rewrites them in the current
+ * format and drops the file.
+ */
+void DB::loadBaseline(istream& is) {
+	while (is) {
+		Index index;
+		is.read((char*)&index.time_stamp, sizeof(time_t));
+		if (is.eof()) break;
+		is.read((char*)&index.key_size, sizeof(index.key_size));
+		char *read_key = new char[index.key_size + 1];
+		is.read(read_key, index.key_size);
+		index.key = string(read_key, index.key_size);
+		delete[] read_key;
+		is.read((char*)&index.id, sizeof(index.id));
+		is.read((char*)&index.offset, sizeof(index.offset));
+		is.read((char*)&index.valid, sizeof(bool));
+		if (is.fail()) {
+			break;		// torn tail
+		}
+		index.seq = ++last_seq;
+		index.inlined = false;
+
+		if (index.valid) {
+			_index.set(index.key, index);
+		} else if (_index.has(index.key)) {
+			_index.del(index.key);
+		}
+	}
+}
+
+bool DB::readIndex(istream& is, Index& index) {
+	char *read_key = new char[index.key_size + 1];
+	is.read(read_key, index.key_size);
+	read_key[index.key_size] = '\0';
+	index.key = string(read_key, index.key_size);
+	delete[] read_key;
+	is.read((char*)&index.id, sizeof(index.id));
+	is.read((char*)&index.offset, sizeof(index.offset));
+	is.read((char*)&index.seq, sizeof(index.seq));
+	is.read((char*)&index.valid, sizeof(bool));
+
+	uint32_t inline_size = NoInline;
+	is.read((char*)&inline_size, sizeof(inline_size));
+	index.inlined = (inline_size != NoInline);
+	if (index.inlined && !is.fail()) {
+		index.value.resize(inline_size);
+		is.read(&index.value[0], inline_size);
+	}
+	last_seq = std::max(last_seq, index.seq);
+	return !is.fail();
+}
+
+Status DB::loadBatch(istream& is) {
+	Status s;
+	uint32_t count = 0, body_size = 0, crc = 0;
+	vector<Index> indexes;
+
+	is.read((char*)&count, sizeof(count));
+	is.read((char*)&body_size, sizeof(body_size));
+	is.read((char*)&crc, sizeof(crc));
+	if (is.fail()) {
+		return s.IOError("Batch header is incomplete.");
+	}
+
+	string body(body_size, '\0');
+	is.read(&body[0], body_size);
+	if (is.fail() || crc32(body.c_str(), body.size()) != crc) {
+		return s.IOError("Batch checksum mismatch.");
+	}
+
+	stringstream bs(body);
+	for (uint32_t i = 0; i < count; ++i) {
+		Index index;
+		bs.read((char*)&index.time_stamp, sizeof(time_t));
+		bs.read((char*)&index.key_size, sizeof(index.key_size));
+		if (bs.fail() || !readIndex(bs, index)) {
+			return s.IOError("Batch body is corrupted.");
+		}
+		indexes.push_back(index);
+	}
+
+	return _index.apply(indexes);
+}
+
+/** the words of a command, split on blanks as the client sent them, without copying **/
+
+static const char* Blanks = " \t\n\v\f\r";
+
+static bool word(string_view& rest, string_view& w) {
+	size_t start = rest.find_first_not_of(Blanks);
+	if (start == string_view::npos) {
+		rest = string_view();
+		return false;
+	}
+	rest.remove_prefix(start);
+	w = rest.substr(0, rest.find_first_of(Blanks));
+	rest.remove_prefix(w.size());
+	return true;
+}
+
+template <typename T>
+static bool number(string_view& rest, T& n) {
+	string_view w;
+	if (!word(rest, w)) {
+		return false;
+	}
+	if (w.size() > 1 && w[0] == '+') {
+		w.remove_prefix(1);
+	}
+	auto res = from_chars(w.data(), w.data() + w.size(), n);
+	return res.ec == errc() && res.ptr == w.data() + w.size();
+}
+
+static void notFound(string_view key, string& res) {	// clients match on this reply
+	res.assign("Key ").append(key).append(" not found.");
+}
+
+static string failure(Status& s, string_view key) {		// the reply to a failed key command
+	string res;
+	if (s.IsNotFound()) {
+		notFound(key, res);
+	} else {
+		res = s.toString();
+	}
+	return res;
+}
+
+string DB::exec(string_view cmd) {
+	Status s;
+	string_view rest = cmd, op, kw, vw;
+	string k, v;
+
+	if (cmd.compare(0, 6, "chunk ") == 0) {	// chunk token bytes, the bytes are raw
+		uint64_t token = 0, received;
+		rest.remove_prefix(6);
+		const char* end = from_chars(rest.data(), rest.data() + rest.size(), token).ptr;
+		size_t start = std::min(rest.size(), (size_t)(end - rest.data()) + 1);
+		s = writeChunk(token, rest.data() + start, rest.size() - start, received);
+		if (!s.ok()) {
+			return s.toString();
+		}
+		return "chunk " + std::to_string(received);
+	}
+
+	word(rest, op);
+	if (op == "set") {
+		word(rest, kw);
+		word(rest, vw);
+		s = set(string(kw), string(vw));
+		if (!s.ok()) {
+			return "set failed";
+		} else {
+			return "set success";
+		}
+	} else if (op == "get") {
+		uint64_t version;
+		word(rest, kw);
+		s = readRecord(string(kw), v, version);		// get without naming a missing key twice
+		if (!s.ok()) {
+			return failure(s, kw);
+		} else {
+			return v;
+		}
+	} else if (op == "del") {
+		word(rest, kw);
+		s = del(string(kw));
+		if (!s.ok()) {
+			return failure(s, kw);
+		} else {
+			return "del success";
+		}
+	} else if (op == "gets") {		// gets k -> version value
+		uint64_t version;
+		word(rest, kw);
+		k.assign(kw);
+		_index.lock_stripe(k);
+		s = readRecord(k, v, version);
+		_index.unlock_stripe(k);
+		if (!s.ok()) {
+			return failure(s, kw);
+		} else {
+			return std::to_string(version) + " " + v;
+		}
+	} else if (op == "incrby") {
+		int64_t delta, result;
+		if (!word(rest, kw) || !number(rest, delta)) {
+			return "invalid command";
+		}
+		s = incrby(string(kw), delta, result);
+		if (!s.ok()) {
+			return failure(s, kw);
+		} else {
+			return std::to_string(result);
+		}
+	} else if (op == "append") {
+		uint64_t length;
+		word(rest, kw);
+		word(rest, vw);
+		s = append(string(kw), string(vw), length);
+		if (!s.ok()) {
+			return failure(s, kw);
+		} else {
+			return std::to_string(length);
+		}
+	} else if (op == "cas") {		// cas k version v
+		uint64_t version, current;
+		if (!word(rest, kw) || !number(rest, version) || !word(rest, vw)) {
+			return "invalid command";
+		}
+		s = cas(string(kw), version, string(vw), current);
+		if (s.IsConflict()) {
+			return "cas conflict " + std::to_string(current);
+		} else if (!s.ok()) {
+			return failure(s, kw);
+		} else {
+			return "cas success " + std::to_string(current);
+		}
+	} else if (op == "getifmodified") {	// getifmodified k version -> not modified | version value
+		uint64_t version, current;
+		if (!word(rest, kw) || !number(rest, version)) {
+			return "invalid command";
+		}
+		s = getIfModified(string(kw), version, v, current);
+		if (!s.ok()) {
+			return failure(s, kw);
+		} else if (current == version) {
+			return "not modified";
+		} else {
+			return std::to_string(current) + " " + v;
+		}
+	} else if (op == "upload") {	// upload k size -> upload token
+		uint64_t size, token;
+		if (!word(rest, kw) || !number(rest, size)) {
+			return "invalid command";
+		}
+		s = beginUpload(string(kw), size, token);
+		if (!s.ok()) {
+			return s.toString();
+		} else {
+			return "upload " + std::to_string(token);
+		}
+	} else if (op == "abort") {		// abort token
+		uint64_t token;
+		if (!number(rest, token)) {
+			return "invalid command";
+		}
+		s = abortUpload(token);
+		if (!s.ok()) {
+			return s.toString();
+		} else {
+			return "abort success";
+		}
+	} else if (op == "getrange") {	// getrange k offset length
+		uint64_t offset, length;
+		if (!word(rest, kw) || !number(rest, offset) || !number(rest, length)) {
+			return "invalid command";
+		}
+		s = getRange(string(kw), offset, length, v);
+		if (!s.ok()) {
+			return failure(s, kw);
+		} else {
+			return v;
+		}
+	} else if (op == "strlen") {
+		uint64_t size;
+		word(rest, kw);
+		s = valueSize(string(kw), size);
+		if (!s.ok()) {
+			return failure(s, kw);
+		} else {
+			return std::to_string(size);
+		}
+	} else if (op == "batch") {		// batch set k1 v1 del k2 ...
+		WriteBatch batch;
+		while (word(rest, op)) {
+			if (op == "set" && word(rest, kw) && word(rest, vw)) {
+				batch.put(string(kw), string(vw));
+			} else if (op == "del" && word(rest, kw)) {
+				batch.del(string(kw));
+			} else {
+				return "invalid command";
+			}
+		}
+		s = write(batch);
+		if (!s.ok()) {
+			return "batch failed";
+		} else {
+			return "batch success";
+		}
+	} else {
+		return "invalid command";
+	}
+}
+
+/**
+ * execute cmd only if it is a read answered from memory, so that event
+ * loop threads can hand writes and disk reads to the execution stage.
+ * The key and index are kept per thread and reused, and a value is copied
+ * straight into res, so once warm a hit allocates nothing but its reply.
+ */
+bool DB::tryExec(string_view cmd, string& res) {
+	thread_local string k, v;
+	thread_local Index index;
+	string_view rest = cmd, op, kw;
+	Status s;
+
+	word(rest, op);
+	if (op == "getifmodified") {	// unchanged or in memory, never waits on disk
+		uint64_t version;
+		if (!word(rest, kw) || !number(rest, version)) {
+			res = "invalid command";
+			return true;
+		}
+		k.assign(kw);
+		_index.lock_stripe(k);	// so that value and version match
+		bool hit = memGet(k, v, index, s);
+		_index.unlock_stripe(k);
+		if (hit && !s.ok()) {
+			notFound(kw, res);
+		} else if (index.seq == version) {
+			res = "not modified";
+		} else if (hit) {
+			res.assign(std::to_string(index.seq)).append(" ").append(v);
+		} else {
+			return false;
+		}
+		return true;
+	}
+	if (op != "get") {
+		return false;
+	}
+
+	word(rest, kw);
+	k.assign(kw);
+	if (memGet(k, res, index, s)) {
+		if (!s.ok()) {
+			notFound(kw, res);
+		}
+		return true;
+	}
+	return false;
+}
+
+bool DB::readOnly(string_view cmd) {
+	string_view op = cmd.substr(0, cmd.find(' '));
+	return op == "get" || op == "gets" || op == "getifmodified" || op == "getrange" || op == "strlen";
+}
+
+void DB::stats(DBStats& st) {
+	vector<string> files;
+	struct stat info;
+
+	st.keys = _index.size();
+	cache.counts(st.cache_hits, st.cache_misses);
+	st.data_files = st.hint_files = 0;
+	st.data_bytes = st.hint_bytes = st.keydir_bytes = 0;
+	env->getChildren(dbname + DataDirectory, files);
+	for (auto& file : files) {		// merge may remove some meanwhile, they are skipped
+		if (stat((dbname + DataDirectory + "/" + file).c_str(), &info) == 0) {
+			++st.data_files;
+			st.data_bytes += info.st_size;
+		}
+	}
+	env->getChildren(dbname + IndexDirectory, files);
+	for (auto& file : files) {
+		if (stat((dbname + IndexDirectory + "/" + file).c_str(), &info) == 0) {
+			++st.hint_files;
+			st.hint_bytes += info.st_size;
+		}
+	}
+	if (options.disk_index && stat((dbname + KeydirFileName).c_str(), &info) == 0) {
+		st.keydir_bytes = info.st_size;
+	}
+	st.keydir_chain = _index.longestChain();
+	st.disk_waits = disk_waits.load(memory_order_relaxed);
+	st.disk_wait_ns = disk_wait_ns.load(memory_order_relaxed);
+	st.merges = merges.load();
+	st.merge_moved = merge_moved.load(memory_order_relaxed);
+	st.merging = merging.load();
+}
+
+/**
+ * exec, except that a get of a large value stored raw answers with the
+ * range of the data file holding it, open in range.fd for the caller to
+ * send and close, so that the value never has to be copied into memory
+ */
+string DB::exec(string_view cmd, FileRange& range) {
+	if (options.zero_copy_size == 0 || cmd.compare(0, 4, "get ") != 0) {
+		return exec(cmd);
+	}
+
+	string_view rest = cmd, op, kw;
+	string k, v;
+	Index index;
+	uint64_t pos;
+	uint32_t val_size;
+	Status s;
+
+	word(rest, op);
+	word(rest, kw);
+	k.assign(kw);
+	if (memGet(k, v, index, s)) {
+		return s.ok() ? v : failure(s, kw);
+	}
+	s = openValue(index, range.fd, pos, val_size);
+	if (s.ok() && !(val_size & CompressedFlag) && val_size >= options.zero_copy_size) {
+		range.offset = pos;
+		range.length = val_size;
+		return "";
+	}
+	if (range.fd >= 0) {
+		::close(range.fd);
+	}
+	range = FileRange();
+
+	s = readData(index, v);
+	return s.ok() ? v : s.toString();
+}
+
+const Snapshot* DB::getSnapshot() {
+	Snapshot* snapshot = new Snapshot;
+
+	// no write is half applied while all stripes are held
+	_index.lock_all();
+	_index.pin();
+	disk_rdlock();
+	snapshot->seq = last_seq;
+	disk_unlock();
+	pthread_mutex_lock(&_snap_lock);
+	snapshots.insert(snapshot->seq);
+	pthread_mutex_unlock(&_snap_lock);
+	_index.unlock_all();
+
+	return snapshot;
+}
+
+void DB::releaseSnapshot(const Snapshot* snapshot) {
+	uint64_t oldest = UINT64_MAX;
+
+	pthread_mutex_lock(&_snap_lock);
+	snapshots.erase(snapshots.find(snapshot->seq));
+	if (!snapshots.empty()) {
+		oldest = *snapshots.begin();
+	}
+	pthread_mutex_unlock(&_snap_lock);
+
+	_index.unpin();
+	_index.trim(oldest);
+	removeObsolete();
+	delete snapshot;
+}
+
+void DB::removeObsolete() {
+	pthread_mutex_lock(&_snap_lock);
+	uint64_t oldest = snapshots.empty() ? UINT64_MAX : *snapshots.begin();
+	for (auto it = obsolete.begin(); it != obsolete.end(); ) {
+		if (oldest >= it->second) {		// no snapshot older than the merge
+			remove((dbname + DataDirectory + "/" + DataFileName + std::to_string(it->first)).c_str());
+			it = obsolete.erase(it);
+		} else {
+			++it;
+		}
+	}
+	pthread_mutex_unlock(&_snap_lock);
+}
+
+/**
+ * copy a record from an old data file to the active one, unless it has
+ * been overwritten or deleted since the merge snapshot was taken
+ */
+Status DB::moveRecord(const Index& old) {
+	Status s;
+	Index index;
+	string value;
+	time_t ts;
+
+	_index.lock_stripe(old.key);
+	s = _index.get(old.key, index);
+	if (!s.ok() || index.seq != old.seq) {
+		_index.unlock_stripe(old.key);
+		return Status();
+	}
+
+	disk_wrlock();
+	s = retrieve(index.key, index.id, index.offset, ts, value);
+	if (s.ok()) {
+		uint64_t off = syncData(makeData(index.key, value, ts));
+		if (off == (uint64_t)-1) {
+			s = s.IOError("Write data failed.");
+		} else {
+			index.id = active_id;
+			index.offset = off;
+			s = syncIndex(index);	// keeps its seq, so versions survive merge
+		}
+	}
+	disk_unlock();
+
+	if (s.ok()) {
+		_index.set(index.key, index);
+	}
+	_index.unlock_stripe(old.key);
+	return s;
+}
+
+/**
+ * Writers switch to fresh files first, then live records of a snapshot
+ * are copied over. Old hint files are removed at once, old data files
+ * once no snapshot older than the merge is alive; a get that looked its
+ * key up before follows the record, see relocated.
+ */
+Status DB::merge() {
+	Status s;
+	uint32_t old_active, old_hint;
+	uint64_t merged_seq;
+	vector<string> index_files, data_files;
+
+	disk_wrlock();
+	pthread_mutex_lock(&_upload_lock);
+	bool uploading = !uploads.empty();
+	pthread_mutex_unlock(&_upload_lock);
+	if (uploading) {	// their records would be left in files merged away
+		disk_unlock();
+		return s.Conflict("Uploads in progress, merge later.");
+	}
+	old_active = active_id;
+	old_hint = hint_id;
+	s = rollData(0);
+	if (s.ok()) {
+		++hint_id;
+		s = newHintFile();
+	}
+	disk_unlock();
+	if (!s.ok()) {
+		return s;
+	}
+
+	const Snapshot* snapshot = getSnapshot();
+	merge_moved = 0;
+	merging = true;
+	for (Iterator it(this, snapshot); it.valid(); it.next()) {
+		if (it.index().id > old_active) {	// written after the switch
+			continue;
+		}
+		s = moveRecord(it.index());
+		if (!s.ok()) {
+			break;
+		}
+		merge_moved.fetch_add(1, memory_order_relaxed);
+	}
+	merging = false;
+	releaseSnapshot(snapshot);
+	if (!s.ok()) {
+		return s;
+	}
+
+	s = env->getChildren(dbname + IndexDirectory, index_files);
+	if (!s.ok()) {
+		return s.IOError("Get children of " + dbname + IndexDirectory + " failed.");
+	}
+	for (auto& file : index_files) {
+		if (static_cast<uint32_t>(atoi(file.c_str() + HintFileName.size())) > old_hint) {
+			continue;
+		}
+		if (remove((dbname + IndexDirectory + "/" + file).c_str()) != 0) {
+			return s.IOError("Remove file " + dbname + IndexDirectory + "/" + file + " failed.");
+		}
+	}
+
+	s = env->getChildren(dbname + DataDirectory, data_files);
+	if (!s.ok()) {
+		return s.IOError("Get children of " + dbname + DataDirectory + " failed.");
+	}
+	disk_rdlock();
+	merged_seq = last_seq;
+	disk_unlock();
+	pthread_mutex_lock(&_snap_lock);
+	for (auto& file : data_files) {
+		uint32_t id = static_cast<uint32_t>(atoi(file.c_str() + DataFileName.size()));
+		if (id <= old_active) {
+			obsolete.push_back(make_pair(id, merged_seq));
+		}
+	}
+	pthread_mutex_unlock(&_snap_lock);
+	removeObsolete();
+	++merges;
+
+	std::cout << "Database size: " << _index.size() << std::endl;
+
+	return s;
+}
+
+
+
+/** Debugger **/
+Debugger::Debugger() {
+	srand((unsigned)time(nullptr));
+}
+
+
+string Debugger::genString() {
+	int len = 10 + rand() % 20;
+	string res(len, 'a');
+	for (auto& ch : res) {
+		ch += rand() % 26;
+	}
+	return res;
+}
+
+void Debugger::test_db() {
+	Status s;
+
+	s = db.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		system("rm -rf tmp___");
+		return; 
+	}
+
+	cout << "====== Test set ======" << endl;
+
+	// generate random kv pair
+	unordered_map<string, string> kv;
+	for (int i = 0; i < 5000; ++i) {
+		string k = genString(), v = genString();
+		kv[k] = v;
+		s = db.set(k, v);
+		if (!s.ok()) {
+			cout << s.toString() << endl;
+			cout << "Set failed" << endl;
+			system("rm -rf tmp___");
+			return;
+		}
+		cout << "Case " << i << " ok" << endl;
+	}
+
+	cout << "====== Set ok ======" << endl;
+
+	cout << "====== Test merge & get ======" << endl;
+	db.merge();
+	s = db.merge();
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+
+	for (auto& p : kv) {
+		string k = p.first, v;
+		s = db.get(k, v);
+		if (!s.ok()) {
+			cout << "Get failed" << endl;
+			system("rm -rf tmp___");
+			return;
+		}
+	}
+
+	cout << "====== Merge & Get ok ======" << endl;
+	
+	cout << "====== Test random get ======" << endl;
+
+	for (int i = 0; i < 1000; ++i) {
+		string k = genString(), v;
+		s = db.get(k, v);
+		if (kv.count(k) && s.IsNotFound() || !kv.count(k) && s.ok()) {
+			cout << "Random get failed" << endl;
+			system("rm -rf tmp___");
+			return;
+		}
+		cout << "Case " << i << " ok" << endl;
+	}
+
+	string v;
+	if (db.get("absent key", v).toString() != "Key absent key not found." ||
+		db.exec("get absent") != "Key absent not found.") {
+		cout << "Miss does not name the key" << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+
+	cout << "====== Random get ok ======" << endl;
+
+	cout << "====== Test del ======" << endl;
+
+	for (auto& p : kv) {
+		string k = p.first;
+		s = db.del(k);
+		if (!s.ok()) {
+			cout << s.toString() << endl;
+			cout << "Del failed" << endl;
+			system("rm -rf tmp___");
+			return;
+		}
+	}
+
+	cout << "====== Del ok ======" << endl;
+
+	cout << "====== Check empty ======" << endl;
+
+	if (!db._index.empty()) {
+		cout << "Not empty! size: " << db._index.size() << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+
+	cout << "====== All test pass ======" << endl;
+	system("rm -rf tmp___");
+}
+
+void Debugger::ui() {
+	string cmd;
+	Status s;
+	s = db.open("tmp___");
+
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+	
+	while (getline(cin, cmd)) {
+		cout << db.exec(cmd) << endl;
+	}
+	system("rm -rf tmp___");
+}
+
+void* work(void* arg) {
+	Job *job = (Job*)arg;
+	string k, v;
+	Status s;
+
+	while (!job->kv->empty()) {
+		// get next job
+		pthread_mutex_lock(job->_lock);
+		if (job->kv->empty()) {
+			pthread_mutex_unlock(job->_lock);
+			break;
+		}
+		auto it = job->kv->begin();
+		k = it->first;
+		v = it->second;
+		job->kv->erase(k);
+		pthread_mutex_unlock(job->_lock);
+	
+		switch (job->op) {
+			case Job::SET:
+				s = job->db->set(k, v);
+				break;
+			case Job::GET:
+				s = job->db->get(k, v);
+				break;
+			case Job::DEL:
+				s = job->db->del(k);
+				break;
+			default:
+				break;
+		}
+	
+		if (!s.ok()) {
+			cout << s.toString() << endl;
+		}
+	}
+
+	return nullptr;
+}
+
+struct MergeJob {
+	DB *db;
+	int keys;
+	atomic<bool> done;
+	atomic<uint64_t> gets, failures;
+};
+
+static void* merge_work(void* arg) {
+	MergeJob* job = (MergeJob*)arg;
+	string v;
+
+	while (!job->done) {
+		for (int i = 0; i < job->keys; ++i) {
+			string k = "merged" + std::to_string(i);
+			Status s = job->db->get(k, v);
+			if (!s.ok() || v != string(100, 'a' + i % 26) + std::to_string(i)) {
+				if (job->failures++ == 0) {
+					cout << k << ": " << s.toString() << " [" << v << "]" << endl;
+				}
+			}
+			++job->gets;
+		}
+	}
+	return nullptr;
+}
+
+void Debugger::test_concurrency() {
+	int thread_num = 20, request_num = 50;
+	pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_t *pids = new pthread_t[thread_num];
+	unordered_map<string, string> kv, cmp;
+	Status s;
+
+	auto clean = [&pids]() {	// cleaner
+		delete[] pids;
+		system("rm -rf tmp___");
+	};
+
+	s = db.open("tmp___");
+	if (!s.ok()) {
+		cout << s.ok() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Concurrency test ======" << endl;
+	// randomly generate kv
+	cout << "Generating random kv pair" << endl;
+	for (int i = 0; i < 2000; ++i) {
+		string k = genString(), v = genString();
+		kv[k] = v;
+		cmp[k] = v;
+	}
+
+	Job job = { &db, &kv, &_lock, Job::SET };
+	for (int i = 0; i < thread_num; ++i) {
+		pthread_create(&pids[i], nullptr, work, (void*)&job);
+	}
+	for (int i = 0; i < thread_num; ++i) {
+		pthread_join(pids[i], nullptr);
+	}
+
+	cout << "Checking results" << endl;
+
+	// check results
+	unordered_map<string, string> result;
+	const Snapshot* snapshot = db.getSnapshot();
+
+	for (Iterator it(&db, snapshot); it.valid(); it.next()) {
+		string value;
+		s = it.value(value);
+		if (!s.ok()) {
+			cout << s.toString() << endl;
+			break;
+		}
+		result[it.key()] = value;
+	}
+	db.releaseSnapshot(snapshot);
+
+	if (result != cmp) {
+		cout << "<!> Concurrency test failed" << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test gets during merge ======" << endl;
+	// too long to inline and more than the cache holds, so that gets read the files merge removes
+	MergeJob merge_job = { &db, 1000, false, 0, 0 };
+	for (int i = 0; i < merge_job.keys; ++i) {
+		db.set("merged" + std::to_string(i), string(100, 'a' + i % 26) + std::to_string(i));
+	}
+	Index stale;		// a get that looked its key up just before merge removed the file
+	string v;
+	int fd;
+	uint64_t pos;
+	uint32_t val_size;
+	db._index.get("merged7", stale);
+	s = db.merge();
+	if (!s.ok() || !db.readData(stale, v).ok() || v != string(100, 'a' + 7) + "7" || !db.openValue(stale, fd, pos, val_size).ok()) {
+		cout << "<!> Read of a merged away file failed " << s.toString() << endl;
+		clean();
+		return;
+	}
+	::close(fd);
+	for (int i = 0; i < 4; ++i) {
+		pthread_create(&pids[i], nullptr, merge_work, (void*)&merge_job);
+	}
+	for (int i = 0; i < 5 && s.ok(); ++i) {
+		s = db.merge();
+	}
+	merge_job.done = true;
+	for (int i = 0; i < 4; ++i) {
+		pthread_join(pids[i], nullptr);
+	}
+	if (!s.ok() || merge_job.failures > 0) {
+		cout << "<!> " << merge_job.failures << " of " << merge_job.gets << " gets failed during merge " << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Concurrency test success ======" << endl;
+	clean();
+}
+
+void Debugger::test_batch() {
+	Status s;
+	unordered_map<string, string> kv;
+
+	s = db.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+
+	cout << "====== Test batch ======" << endl;
+
+	WriteBatch batch;
+	for (int i = 0; i < 1000; ++i) {
+		string k = genString(), v = genString();
+		kv[k] = v;
+		batch.put(k, v);
+	}
+	s = db.write(batch);
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+
+	// delete half of them in another batch
+	batch.clear();
+	int n = 0;
+	for (auto it = kv.begin(); it != kv.end(); ++n) {
+		if (n % 2) {
+			batch.del(it->first);
+			it = kv.erase(it);
+		} else {
+			++it;
+		}
+	}
+	s = db.write(batch);
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+
+	cout << "====== Test recovery ======" << endl;
+	db.close();
+	DB reopened;
+	s = reopened.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+
+	if (reopened._index.size() != kv.size()) {
+		cout << "<!> Size mismatch: " << reopened._index.size() << " vs " << kv.size() << endl;
+		system("rm -rf tmp___");
+		return;
+	}
+	for (auto& p : kv) {
+		string v;
+		s = reopened.get(p.first, v);
+		if (!s.ok() || v != p.second) {
+			cout << "<!> Batch test failed on key " << p.first << endl;
+			system("rm -rf tmp___");
+			return;
+		}
+	}
+
+	cout << "====== Batch test success ======" << endl;
+	system("rm -rf tmp___");
+}
+
+struct RmwJob {
+	DB *db;
+	string key;
+	int rounds;
+};
+
+void* rmw_work(void* arg) {
+	RmwJob *job = (RmwJob*)arg;
+	int64_t result;
+	uint64_t length;
+
+	for (int i = 0; i < job->rounds; ++i) {
+		job->db->incrby(job->key, 1, result);
+		job->db->append(job->key + "_log", "x", length);
+	}
+	return nullptr;
+}
+
+void Debugger::test_rmw() {
+	int thread_num = 10, rounds = 200;
+	pthread_t *pids = new pthread_t[thread_num];
+	Status s;
+	string v;
+	uint64_t version, current;
+
+	auto clean = [&pids]() {	// cleaner
+		delete[] pids;
+		system("rm -rf tmp___");
+	};
+
+	s = db.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test incrby & append ======" << endl;
+	RmwJob job = { &db, "counter", rounds };
+	for (int i = 0; i < thread_num; ++i) {
+		pthread_create(&pids[i], nullptr, rmw_work, (void*)&job);
+	}
+	for (int i = 0; i < thread_num; ++i) {
+		pthread_join(pids[i], nullptr);
+	}
+
+	db.get("counter", v);
+	if (v != std::to_string(thread_num * rounds)) {
+		cout << "<!> Counter is " << v << ", expected " << thread_num * rounds << endl;
+		clean();
+		return;
+	}
+	db.get("counter_log", v);
+	if (v.size() != (size_t)(thread_num * rounds)) {
+		cout << "<!> Appended length is " << v.size() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test cas ======" << endl;
+	s = db.get("counter", v, version);
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+	s = db.cas("counter", version, "0", current);
+	if (!s.ok()) {
+		cout << "<!> Cas with right version failed" << endl;
+		clean();
+		return;
+	}
+	s = db.cas("counter", version, "1", current);
+	if (!s.IsConflict() || current <= version) {
+		cout << "<!> Cas with stale version succeeded" << endl;
+		clean();
+		return;
+	}
+	s = db.cas("fresh", 0, "1", current);
+	if (!s.ok()) {
+		cout << "<!> Cas on absent key failed" << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test getifmodified ======" << endl;
+	string res;
+	s = db.getIfModified("fresh", current, v, version);
+	if (!s.ok() || version != current || !v.empty() ||
+		!db.tryExec("getifmodified fresh " + std::to_string(current), res) || res != "not modified") {
+		cout << "<!> Unchanged value was sent again" << endl;
+		clean();
+		return;
+	}
+	if (db.exec("getifmodified fresh " + std::to_string(current - 1)) != std::to_string(current) + " 1" ||
+		!db.getIfModified("absent", 0, v, version).IsNotFound()) {
+		cout << "<!> Getifmodified of changed or absent key failed" << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test versions across merge and restart ======" << endl;
+	db.set("reused", "a");
+	db.get("reused", v, version);
+	db.del("reused");		// its tombstone takes version + 1, then merge drops it
+	if (!db.merge().ok()) {
+		cout << "<!> Merge failed" << endl;
+		clean();
+		return;
+	}
+	db.close();
+	DB reopened;
+	s = reopened.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+	reopened.set("reused", "b");
+	reopened.get("reused", v, current);
+	if (current <= version + 1) {
+		cout << "<!> Version " << current << " handed out again, was at " << version + 1 << endl;
+		clean();
+		return;
+	}
+	uint64_t seen;
+	if (!reopened.tryExec("getifmodified reused " + std::to_string(version), res) || res != std::to_string(current) + " b" ||
+		!reopened.getIfModified("reused", version, v, seen).ok() || v != "b" ||
+		!reopened.cas("reused", version, "c", seen).IsConflict() || !reopened.cas("reused", version + 1, "c", seen).IsConflict()) {
+		cout << "<!> Version from before the restart still matches" << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== RMW test success ======" << endl;
+	clean();
+}
+
+void Debugger::test_snapshot() {
+	Status s;
+	unordered_map<string, string> before, seen;
+
+	auto clean = []() {	// cleaner
+		system("rm -rf tmp___");
+	};
+
+	s = db.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test snapshot ======" << endl;
+	for (int i = 0; i < 500; ++i) {
+		string k = genString(), v = genString();
+		before[k] = v;
+		db.set(k, v);
+	}
+
+	const Snapshot* snapshot = db.getSnapshot();
+
+	// overwrite, delete and insert behind the snapshot's back
+	int n = 0;
+	for (auto& p : before) {
+		if (n % 3 == 0) {
+			db.set(p.first, genString());
+		} else if (n % 3 == 1) {
+			db.del(p.first);
+		}
+		++n;
+	}
+	for (int i = 0; i < 100; ++i) {
+		db.set(genString(), genString());
+	}
+
+	s = db.merge();
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	for (Iterator it(&db, snapshot); it.valid(); it.next()) {
+		string v;
+		s = it.value(v);
+		if (!s.ok()) {
+			cout << "<!> Read snapshot failed: " << s.toString() << endl;
+			clean();
+			return;
+		}
+		seen[it.key()] = v;
+	}
+	if (seen != before) {
+		cout << "<!> Snapshot is not consistent" << endl;
+		clean();
+		return;
+	}
+
+	db.releaseSnapshot(snapshot);
+	if (db.env->existFile("tmp___" + DataDirectory + "/" + DataFileName + "0")) {
+		cout << "<!> Merged data file is not removed" << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Snapshot test success ======" << endl;
+	clean();
+}
+
+void Debugger::test_disk_index() {
+	Status s;
+	Options options;
+	unordered_map<string, string> kv;
+
+	auto clean = []() {	// cleaner
 		system("rm -rf tmp___");
+	};
+
+	options.disk_index = true;
+	options.index_pages = BucketSize;	// one page per bucket, forces splits
+	s = db.open("tmp___", options);
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test disk index ======" << endl;
+	for (int i = 0; i < 50000; ++i) {
+		string k = genString(), v = genString();
+		kv[k] = v;
+		db.set(k, v);
+	}
+	int n = 0;
+	for (auto it = kv.begin(); it != kv.end(); ++n) {
+		if (n % 4 == 0) {
+			db.del(it->first);
+			it = kv.erase(it);
+		} else {
+			if (n % 4 == 1) {
+				it->second = genString();
+				db.set(it->first, it->second);
+			}
+			++it;
+		}
+	}
+
+	cout << "====== Test recovery ======" << endl;
+	db.close();
+	DB reopened;
+	s = reopened.open("tmp___", options);
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+	if (reopened._index.size() != kv.size()) {
+		cout << "<!> Size mismatch: " << reopened._index.size() << " vs " << kv.size() << endl;
+		clean();
+		return;
+	}
+	DBStats st;
+	reopened.stats(st);
+	if (st.keydir_chain > 3) {		// 37500 entries would make chains of 4 pages and more unless split
+		cout << "<!> Longest chain is " << st.keydir_chain << ", full buckets were not split" << endl;
+		clean();
+		return;
+	}
+
+	unordered_map<string, string> seen;
+	const Snapshot* snapshot = reopened.getSnapshot();
+	for (Iterator it(&reopened, snapshot); it.valid(); it.next()) {
+		it.value(seen[it.key()]);
+	}
+	reopened.releaseSnapshot(snapshot);
+	if (seen != kv) {
+		cout << "<!> Disk index content mismatch" << endl;
+		clean();
 		return;
 	}
-	
-	while (getline(cin, cmd)) {
-		cout << db.exec(cmd) << endl;
+	for (int i = 0; i < 1000; ++i) {
+		string k = genString(), v;
+		if (reopened.get(k, v).ok() != (kv.count(k) > 0)) {
+			cout << "<!> Random get failed" << endl;
+			clean();
+			return;
+		}
 	}
-	system("rm -rf tmp___");
+
+	cout << "====== Disk index test success ======" << endl;
+	clean();
 }
 
-void* work(void* arg) {
-	Job *job = (Job*)arg;
-	string k, v;
+void Debugger::test_rollover() {
 	Status s;
+	vector<string> values;
+	struct stat st;
 
-	while (!job->kv->empty()) {
-		// get next job
-		pthread_mutex_lock(job->_lock);
-		if (job->kv->empty()) break;
-		auto it = job->kv->begin();
-		k = it->first;
-		v = it->second;
-		job->kv->erase(k);
-		pthread_mutex_unlock(job->_lock);
-	
-		switch (job->op) {
-			case Job::SET:
-				s = job->db->set(k, v);
-				break;
-			case Job::GET:
-				s = job->db->get(k, v);
-				break;
-			case Job::DEL:
-				s = job->db->del(k);
-				break;
-			default:
-				break;
+	auto clean = []() {	// cleaner
+		system("rm -rf tmp___");
+	};
+
+	s = db.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test rollover ======" << endl;
+	// 1M incompressible values, so that more than one data file is needed
+	for (int i = 0; i < 100; ++i) {
+		values.push_back(string(1 << 20, '\0'));
+		for (auto& ch : values.back()) {
+			ch = (char)(rand() % 256);
 		}
-	
+		s = db.set("key" + std::to_string(i), values.back());
 		if (!s.ok()) {
 			cout << s.toString() << endl;
+			clean();
+			return;
+		}
+	}
+	if (db.active_id == 0) {
+		cout << "<!> Data file not rolled over" << endl;
+		clean();
+		return;
+	}
+
+	db.close();
+	stat(("tmp___" + DataDirectory + "/" + DataFileName + "0").c_str(), &st);
+	if ((uint64_t)st.st_size >= MaxDataFileSize) {
+		cout << "<!> Data file not sealed, size " << st.st_size << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test recovery ======" << endl;
+	DB reopened;
+	s = reopened.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+	for (int i = 0; i < 100; ++i) {
+		string v;
+		s = reopened.get("key" + std::to_string(i), v);
+		if (!s.ok() || v != values[i]) {
+			cout << "<!> Value " << i << " mismatch" << endl;
+			clean();
+			return;
 		}
 	}
+	reopened.set("last", "one");
+	reopened.close();
 
-	return nullptr;
+	cout << "====== Test baseline hint format ======" << endl;
+	clean();
+	system("mkdir -p tmp___/data tmp___/index");
+	{	// a store written before hint files had a header: three records and a delete
+		ofstream data("tmp___" + DataDirectory + "/" + DataFileName + "0", std::ios::binary);
+		ofstream hint("tmp___" + IndexDirectory + "/" + HintFileName + "0", std::ios::binary);
+		time_t now = time(nullptr);
+		uint32_t id = 0, zero = 0;
+		uint64_t offset = 0;
+		for (int i = 0; i < 4; ++i) {
+			string key = "old" + std::to_string(i < 3 ? i : 1), value = "value" + std::to_string(i);
+			uint32_t key_size = key.size(), val_size = value.size();
+			bool valid = (i < 3);
+			if (valid) {
+				data.write((char*)&now, sizeof(now));
+				data.write((char*)&key_size, sizeof(key_size));
+				data.write((char*)&val_size, sizeof(val_size));
+				data.write(key.c_str(), key_size);
+				data.write(value.c_str(), val_size);
+				data.write((char*)&zero, sizeof(zero));
+				data.write((char*)&zero, sizeof(zero));
+			}
+			hint.write((char*)&now, sizeof(now));
+			hint.write((char*)&key_size, sizeof(key_size));
+			hint.write(key.c_str(), key_size);
+			hint.write((char*)&id, sizeof(id));
+			hint.write((char*)&offset, sizeof(offset));
+			hint.write((char*)&valid, sizeof(valid));
+			offset += sizeof(now) + sizeof(key_size) + sizeof(val_size) + key_size + val_size + sizeof(zero) * 2;
+		}
+	}
+	DB baseline;
+	s = baseline.open("tmp___");
+	if (!s.ok()) {
+		cout << "<!> Baseline store not opened: " << s.toString() << endl;
+		clean();
+		return;
+	}
+	string v;
+	uint64_t version = 0;
+	if (!baseline.get("old1", v).IsNotFound() || !baseline.get("old2", v).ok() || v != "value2") {
+		cout << "<!> Baseline store read wrong" << endl;
+		clean();
+		return;
+	}
+	baseline.set("old0", "new");
+	if (!baseline.get("old0", v, version).ok() || v != "new" || version <= 3) {
+		cout << "<!> Baseline store reused seq " << version << endl;
+		clean();
+		return;
+	}
+	s = baseline.merge();
+	baseline.close();
+	vector<string> hints;
+	Env().getChildren("tmp___" + IndexDirectory, hints);
+	for (auto& file : hints) {
+		uint32_t magic = 0;
+		ifstream ifs("tmp___" + IndexDirectory + "/" + file, std::ios::binary);
+		ifs.read((char*)&magic, sizeof(magic));
+		if (!s.ok() || magic != HintMagic) {
+			cout << "<!> Hint file " << file << " not rewritten by merge: " << s.toString() << endl;
+			clean();
+			return;
+		}
+	}
+	DB upgraded;
+	s = upgraded.open("tmp___");
+	if (!s.ok() || !upgraded.get("old0", v).ok() || v != "new" || !upgraded.get("old2", v).ok() || v != "value2"
+		|| !upgraded.get("old1", v).IsNotFound()) {
+		cout << "<!> Merged baseline store read wrong: " << s.toString() << endl;
+		clean();
+		return;
+	}
+	upgraded.close();
+
+	cout << "====== Test hint format ======" << endl;
+	uint32_t future[2] = { HintMagic, HintVersion + 1 };
+	ofstream ofs("tmp___" + IndexDirectory + "/" + HintFileName + "999", std::ios::binary);
+	ofs.write((char*)future, sizeof(future));
+	ofs.write((char*)&version, sizeof(version));
+	ofs.close();
+	DB refused;
+	s = refused.open("tmp___");
+	if (!s.IsInvalidArgument()) {
+		cout << "<!> Hint file of another format was opened: " << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Rollover test success ======" << endl;
+	clean();
 }
 
-void Debugger::test_concurrency() {
-	int thread_num = 20, request_num = 50;
-	pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
-	pthread_t *pids = new pthread_t[thread_num];
-	unordered_map<string, string> kv, cmp;
+void Debugger::test_compression() {
 	Status s;
+	unordered_map<string, string> kv;
+	struct stat st;
 
-	auto clean = [&pids]() {	// cleaner
-		delete[] pids;
+	auto clean = []() {	// cleaner
 		system("rm -rf tmp___");
 	};
 
+	cout << "====== Test codec ======" << endl;
+	for (int i = 0; i < 200; ++i) {
+		string raw;
+		int len = rand() % 20000;
+		for (int j = 0; j < len; ++j) {		// mix of runs and noise
+			raw += (rand() % 4 == 0) ? (char)(rand() % 256) : (char)('a' + j / 50 % 3);
+		}
+		string buf(raw.size() + raw.size() / 255 + 16, '\0'), back(raw.size(), '\0');
+		size_t n = lz4_compress(raw.c_str(), raw.size(), &buf[0], buf.size());
+		if (n == 0 || !lz4_decompress(buf.c_str(), n, &back[0], back.size()) || back != raw) {
+			cout << "<!> Codec round trip failed, length " << len << endl;
+			return;
+		}
+	}
+
 	s = db.open("tmp___");
 	if (!s.ok()) {
-		cout << s.ok() << endl;
+		cout << s.toString() << endl;
 		clean();
 		return;
 	}
 
-	cout << "====== Concurrency test ======" << endl;
-	// randomly generate kv
-	cout << "Generating random kv pair" << endl;
-	for (int i = 0; i < 2000; ++i) {
-		string k = genString(), v = genString();
-		kv[k] = v;
-		cmp[k] = v;
+	cout << "====== Test compressed records ======" << endl;
+	uint64_t raw_bytes = 0;
+	for (int i = 0; i < 200; ++i) {
+		string v;
+		while (v.size() < 4096) {	// json-like and compressible
+			v += "{\"id\":" + std::to_string(i) + ",\"name\":\"" + genString() + "\",\"tags\":[\"a\",\"b\"]},";
+		}
+		if (i % 10 == 0) {	// incompressible ones are stored raw
+			for (auto& ch : v) {
+				ch = (char)(rand() % 256);
+			}
+		}
+		kv["key" + std::to_string(i)] = v;
+		raw_bytes += v.size();
+		db.set("key" + std::to_string(i), v);
+	}
+	s = db.merge();
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
 	}
+	db.close();
 
-	Job job = { &db, &kv, &_lock, Job::SET };
-	for (int i = 0; i < thread_num; ++i) {
-		pthread_create(&pids[i], nullptr, work, (void*)&job);
+	stat(("tmp___" + DataDirectory + "/" + DataFileName + std::to_string(db.active_id)).c_str(), &st);
+	if ((uint64_t)st.st_size * 2 > raw_bytes) {
+		cout << "<!> Data file is " << st.st_size << " bytes for " << raw_bytes << " raw bytes" << endl;
+		clean();
+		return;
 	}
-	for (int i = 0; i < thread_num; ++i) {
-		pthread_join(pids[i], nullptr);
+
+	DB reopened;
+	s = reopened.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+	for (auto& p : kv) {
+		string v;
+		s = reopened.get(p.first, v);
+		if (!s.ok() || v != p.second) {
+			cout << "<!> Value of " << p.first << " mismatch" << endl;
+			clean();
+			return;
+		}
 	}
 
-	cout << "Checking results" << endl;
+	cout << "====== Compression test success ======" << endl;
+	clean();
+}
 
-	// check results
-	unordered_map<string, string> result;
-	unordered_map<string, Index> _whole_index;
-	
-	db._index.copyTo(_whole_index);
-	for (auto& p : _whole_index) {
-		string value;
-		s = db.get(p.first, value);
+struct UploadJob {
+	DB *db;
+	uint64_t token;
+};
+
+static void* upload_work(void* arg) {
+	UploadJob* job = (UploadJob*)arg;
+	string chunk(4096, 'u');
+	uint64_t received;
+	while (job->db->writeChunk(job->token, chunk.c_str(), chunk.size(), received).ok() && received < (64 << 20)) {
+	}
+	return nullptr;
+}
+
+void Debugger::test_stream() {
+	Status s;
+	string big(5 << 20, '\0'), v;
+	uint64_t token, received = 0, size;
+
+	auto clean = []() {	// cleaner
+		system("rm -rf tmp___");
+	};
+
+	for (auto& ch : big) {		// binary, spaces included
+		ch = (char)(rand() % 256);
+	}
+
+	s = db.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test chunked upload ======" << endl;
+	s = db.beginUpload("big", big.size(), token);
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+	if (!db.merge().IsConflict() || db.get("big", v).ok()) {
+		cout << "<!> Upload visible or merged before completion" << endl;
+		clean();
+		return;
+	}
+	for (size_t off = 0; off < big.size(); off += 65536) {
+		s = db.writeChunk(token, big.c_str() + off, std::min((size_t)65536, big.size() - off), received);
 		if (!s.ok()) {
 			cout << s.toString() << endl;
-			break;
+			clean();
+			return;
 		}
-		result[p.first] = value;
+	}
+	if (received != big.size() || !db.get("big", v).ok() || v != big) {
+		cout << "<!> Uploaded value mismatch" << endl;
+		clean();
+		return;
 	}
 
-	if (result == cmp) {
-		cout << "====== Concurrency test success ======" << endl;
-	} else {
-		cout << "<!> Concurrency test failed" << endl;
+	string res = db.exec("upload small 11");
+	token = atoll(res.c_str() + 7);
+	if (db.exec("chunk " + std::to_string(token) + " hello ") != "chunk 6" ||
+		db.exec("chunk " + std::to_string(token) + " world") != "chunk 11" ||
+		!db.get("small", v).ok() || v != "hello world") {
+		cout << "<!> Upload through exec failed" << endl;
+		clean();
+		return;
+	}
+	res = db.exec("upload aborted 100");
+	if (db.exec("abort " + res.substr(7)) != "abort success" || db.get("aborted", v).ok()) {
+		cout << "<!> Abort upload failed" << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test abort under writers ======" << endl;
+	pthread_t pids[4];
+	UploadJob job = { &db, 0 };
+	s = db.beginUpload("raced", 64 << 20, job.token);
+	for (int i = 0; i < 4; ++i) {
+		pthread_create(&pids[i], nullptr, upload_work, (void*)&job);
+	}
+	usleep(2000);
+	bool aborted = db.abortUpload(job.token).ok();
+	for (int i = 0; i < 4; ++i) {
+		pthread_join(pids[i], nullptr);
+	}
+	if (!s.ok() || db.uploading(job.token) || db.writeChunk(job.token, "u", 1, received).ok() ||
+		(aborted ? db.get("raced", v).ok() : !db.get("raced", v).ok() || v != string(64 << 20, 'u'))) {
+		cout << "<!> Upload raced with abort" << endl;
+		clean();
+		return;
+	}
+	if (!db.merge().ok()) {		// nothing left open to hold it off
+		cout << "<!> Merge after abort failed" << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test ranged reads ======" << endl;
+	db.close();
+	DB reopened;
+	s = reopened.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+	if (!reopened.valueSize("big", size).ok() || size != big.size()) {
+		cout << "<!> Size of big is " << size << endl;
+		clean();
+		return;
+	}
+	for (int i = 0; i < 100; ++i) {
+		uint64_t off = rand() % (big.size() + 100), len = rand() % 200000;
+		s = reopened.getRange("big", off, len, v);
+		if (!s.ok() || v != (off < big.size() ? big.substr(off, len) : "")) {
+			cout << "<!> Range " << off << "+" << len << " mismatch" << endl;
+			clean();
+			return;
+		}
+	}
+	FileRange range;
+	if (reopened.exec("get big", range) != "" || range.fd < 0 || range.length != big.size()) {
+		cout << "<!> Big value is not sent from its file" << endl;
+		clean();
+		return;
+	}
+	v.assign(range.length, '\0');
+	if (pread(range.fd, &v[0], range.length, range.offset) != (ssize_t)range.length || v != big) {
+		cout << "<!> File range of big mismatch" << endl;
+		clean();
+		return;
+	}
+	::close(range.fd);
+
+	string zipped(100000, 'z');		// compressed records are sliced after decoding
+	reopened.set("zipped", zipped);
+	reopened.cache.del("zipped");
+	if (reopened.exec("getrange zipped 99990 20") != zipped.substr(99990) ||
+		reopened.exec("strlen zipped") != "100000" || reopened.exec("getrange small 6 5") != "world" ||
+		reopened.exec("get zipped", range) != zipped || range.fd >= 0) {
+		cout << "<!> Range of compressed or small value mismatch" << endl;
+		clean();
+		return;
+	}
+	string streamed(2 << 20, 's');		// compresses well, but too long to be worth it
+	reopened.set("streamed", streamed);
+	reopened.cache.del("streamed");
+	if (reopened.exec("get streamed", range) != "" || range.fd < 0 || range.length != streamed.size() ||
+		reopened.exec("getrange streamed 1048570 6") != "ssssss") {
+		cout << "<!> Long value was compressed" << endl;
+		clean();
+		return;
+	}
+	::close(range.fd);
+	reopened.close();
+
+	cout << "====== Test chunk and range limits ======" << endl;
+	DB limited;
+	Options options;
+	options.max_chunk = 4096;
+	s = limited.open("tmp___", options);
+	if (!s.ok() || !limited.beginUpload("limited", 8192, token).ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+	string chunk(4097, 'c');
+	if (!limited.writeChunk(token, chunk.c_str(), chunk.size(), received).IsInvalidArgument() ||
+		!limited.writeChunk(token, chunk.c_str(), 4096, received).ok() || received != 4096 ||
+		!limited.getRange("big", 0, 4097, v).IsInvalidArgument() ||
+		!limited.getRange("big", 4096, 4096, v).ok() || v != big.substr(4096, 4096) ||
+		limited.exec("getrange big 0 5000") != "Range of 5000 bytes is over the limit of 4096.") {
+		cout << "<!> Chunk or range over the limit was taken" << endl;
+		clean();
+		return;
+	}
+	limited.abortUpload(token);
+
+	cout << "====== Stream test success ======" << endl;
+	clean();
+}
+
+void Debugger::test_stats() {
+	Status s;
+	DBStats st;
+	string v;
+
+	auto clean = []() {	// cleaner
+		system("rm -rf tmp___");
+	};
+
+	s = db.open("tmp___");
+	if (!s.ok()) {
+		cout << s.toString() << endl;
+		clean();
+		return;
+	}
+
+	cout << "====== Test engine stats ======" << endl;
+	for (int i = 0; i < 100; ++i) {
+		db.set("key" + std::to_string(i), string(1000, 'a' + i % 26));		// too long to be inlined
+	}
+	db.cache.del("key0");
+	db.get("key0", v);		// from disk
+	db.get("key1", v);		// cached by set
+	db.stats(st);
+	if (st.keys != 100 || st.cache_hits < 1 || st.cache_misses < 1) {
+		cout << "<!> " << st.keys << " keys, " << st.cache_hits << " hits, " << st.cache_misses << " misses" << endl;
+		clean();
+		return;
+	}
+	if (st.data_files < 1 || st.data_bytes == 0 || st.keydir_bytes != 0) {
+		cout << "<!> " << st.data_files << " data files of " << st.data_bytes << " bytes" << endl;
+		clean();
+		return;
+	}
+
+	Trace trace;
+	Trace::current = &trace;
+	db.cache.del("key2");
+	db.get("key2", v);
+	db.set("key2", v);
+	Trace::current = nullptr;
+	db.get("key3", v);		// not traced
+	if (trace.ns[STAGE_READ] == 0 || trace.ns[STAGE_WRITE] == 0) {
+		cout << "<!> Traced read " << trace.ns[STAGE_READ] << "ns, write " << trace.ns[STAGE_WRITE] << "ns" << endl;
+		clean();
+		return;
+	}
+
+	streambuf* out = cout.rdbuf(nullptr);		// merge reports the database size
+	s = db.merge();
+	cout.rdbuf(out);
+	cout.clear();
+	db.stats(st);
+	if (!s.ok() || st.merges != 1 || st.merge_moved != 100 || st.merging) {
+		cout << "<!> " << st.merges << " merges moved " << st.merge_moved << " records" << endl;
+		clean();
+		return;
 	}
 
+	cout << "====== Stats test success ======" << endl;
 	clean();
 }
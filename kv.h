@@ -9,12 +9,18 @@
 #include <cstring>
 #include <unordered_map>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <cstdint>
 #include <fstream>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sstream>
+#include <string_view>
 #include <pthread.h>
 #include <errno.h>
 
@@ -26,9 +32,15 @@ const string DataDirectory = "/data";
 const string HintFileName = "hint";
 const string DataFileName = "data";
 const string LockFileName = "/LOCK";
+const string KeydirFileName = "/keydir";
 const uint32_t MaxDataFileSize = 1 << 26;	// 64M
 const uint32_t MaxHintFileSize = 1 << 25;
 const uint32_t BucketSize = 107;
+const uint32_t BatchMarker = 0xFFFFFFFF;	// key_size of a batch record in hint file
+const uint32_t NoInline = 0xFFFFFFFF;		// value size of a hint entry without inlined value
+const uint32_t CompressedFlag = 1u << 31;	// set in val_size of a compressed record
+const uint32_t HintMagic = 0x544e4948;		// "HINT", first in every hint file
+const uint32_t HintVersion = 2;			// layout of the header and the hint entries after it
 
 
 struct Data {
@@ -39,6 +51,7 @@ struct Data {
 	string value;
 	uint32_t crc;
 	uint32_t magic;
+	bool compressed;	// value is raw size | lz4 block, flagged in val_size
 };
 
 struct Index {
@@ -47,7 +60,92 @@ struct Index {
 	string key;
 	uint32_t id;		// data file number
 	uint64_t offset;
+	uint64_t seq;		// sequence number of the write, used as version
 	bool valid;
+	bool inlined;		// small values are kept here as well, see Options::inline_size
+	string value;
+};
+
+struct Version {		// an overwritten index kept for snapshots
+	Index index;
+	uint64_t until;		// visible to snapshots in [index.seq, until)
+};
+
+struct Snapshot {
+	uint64_t seq;		// sees every write with seq <= this
+};
+
+struct DataFile {		// a preallocated data file, written through mmap
+	uint32_t id;
+	int fd;
+	char* map;
+	uint64_t capacity;
+
+	DataFile() : id(0), fd(-1), map(nullptr), capacity(0) {}
+};
+
+struct Upload {		// a value streamed into a record reserved in a data file
+	string key;
+	time_t time_stamp;
+	uint32_t id;		// data file the record is reserved in
+	uint64_t offset;	// of the record
+	uint64_t pos;		// of its value
+	uint64_t size;
+	uint64_t claimed;	// bytes handed out to writers, written or in flight
+	uint64_t received;	// bytes written
+	uint32_t writers;	// chunks being written, fd stays open until they are done
+	bool aborted;		// gone for everyone, the last writer closes fd
+	int fd;
+};
+
+struct FileRange {	// bytes of a data file sent to the client as they are
+	int fd;
+	uint64_t offset;
+	uint64_t length;
+
+	FileRange() : fd(-1), offset(0), length(0) {}
+};
+
+struct Options {
+	bool disk_index;		// keep the keydir in an mmap'd file instead of memory
+	uint32_t index_pages;	// primary pages of the disk keydir, 4K each
+	uint32_t inline_size;	// values shorter than this are served from the index, 0 disables
+	uint32_t compress_size;	// values at least this long are compressed, 0 disables
+	uint32_t zero_copy_size;	// stored values at least this long may be sent from their file, 0 disables
+	uint32_t stream_size;	// values at least this long stay uncompressed, so ranges read only their part, 0 disables
+	uint32_t max_chunk;		// longest chunk written or range read at once, 0 disables
+
+	Options() : disk_index(false), index_pages(1 << 16), inline_size(32), compress_size(1024), zero_copy_size(16384), stream_size(1 << 20), max_chunk(1 << 26) {}
+};
+
+struct DBStats {		// a look at the engine, see DB::stats
+	uint64_t keys;
+	uint64_t cache_hits, cache_misses;
+	uint32_t data_files, hint_files;
+	uint64_t data_bytes, hint_bytes;
+	uint64_t keydir_bytes;		// of the disk keydir, 0 when it is in memory
+	uint32_t keydir_chain;		// pages in its longest chain, 0 when it is in memory
+	uint64_t disk_waits, disk_wait_ns;		// disk lock acquisitions that had to wait
+	uint64_t merges;		// completed
+	uint64_t merge_moved;		// live records copied by the running or last merge
+	bool merging;
+};
+
+enum stage_t { STAGE_INDEX_LOCK = 0, STAGE_CACHE_LOCK, STAGE_DISK_LOCK, STAGE_READ, STAGE_WRITE, STAGES };
+
+/**
+ * where a traced request spent its time inside the engine, in ns. The
+ * thread running the request points current at it; while current is null
+ * the engine reads no clock for tracing. Lock stages count only waits.
+ */
+struct Trace {
+	uint64_t ns[STAGES];
+
+	Trace() : ns{ 0 } {}
+	static thread_local Trace* current;
+	static uint64_t begin();		// now, or 0 when not tracing
+	static void end(stage_t stage, uint64_t start);
+	static void add(stage_t stage, uint64_t ns);
 };
 
 struct FileLock {
@@ -61,6 +159,9 @@ class Status;
 class Env;
 class Cache;
 class Map;
+class WriteBatch;
+class Iterator;
+class DiskMap;
 
 /**
  * Map
@@ -71,25 +172,75 @@ class Map;
 class Map {
 public:
 	Map();
+	~Map();
+	Status openDisk(const string& path, uint32_t pages);	// keep the index on disk
 	Status set(const string& key, const Index& index);
 	Status get(const string& key, Index& index);
-	Status del(const string& key);
+	Status get(const string& key, Index& index, uint64_t seq);	// as seen by a snapshot
+	Status del(const string& key, uint64_t seq = 0);
+	Status apply(const vector<Index>& indexes);	// update several keys at once
+
+	// stripes serialize writers of the same key across index, disk and cache
+	Status lock_stripe(const string& key);
+	Status unlock_stripe(const string& key);
+	Status lock_stripes(const vector<string>& keys);
+	Status unlock_stripes(const vector<string>& keys);
+	Status lock_all();
+	Status unlock_all();
+
+	// while pinned, overwritten and deleted indexes are kept as versions
+	void pin() { ++pinned; }
+	void unpin() { --pinned; }
+	void trim(uint64_t oldest);		// drop versions invisible to all snapshots
+	void collect(uint32_t bucketno, uint64_t seq, vector<Index>& entries);
 	
 	bool has(const string& key);
 	bool empty();
 	uint64_t size();
+	uint32_t longestChain();	// of the disk keydir, 0 without one
 	void clear();
-	void copyTo(unordered_map<string, Index>& _whole_index);
 private:
 	vector<unordered_map<string, Index>> maps;
+	vector<vector<Version>> history;
 	vector<pthread_rwlock_t> lockset;
+	vector<pthread_mutex_t> stripes;
+	atomic<uint32_t> pinned;
+	DiskMap* disk;		// if set, replaces maps
 
+	bool lookup(uint32_t bucketno, const string& key, Index& index);
+	bool store(uint32_t bucketno, const Index& index);
+	bool erase(uint32_t bucketno, const string& key);
+	void retain(uint32_t bucketno, const string& key, uint64_t until);
+
+	vector<uint32_t> bucketsOf(const vector<string>& keys);
 	Status rdlock_key(const string& key);
 	Status wrlock_key(const string& key);
 	Status unlock_key(const string& key);
 	uint32_t hash(const string& key);
 };
 
+/**
+ * WriteBatch
+ *
+ * collect puts and deletes, DB::write applies them atomically
+ */
+
+class WriteBatch {
+	friend class DB;
+public:
+	void put(const string& key, const string& value);
+	void del(const string& key);
+	void clear() { ops.clear(); }
+	uint32_t count() { return static_cast<uint32_t>(ops.size()); }
+private:
+	enum type_t { PUT = 0, DEL = 1 };
+	struct Op {
+		type_t type;
+		string key, value;
+	};
+	vector<Op> ops;
+};
+
 /**
  * Cache
  *
@@ -110,14 +261,22 @@ public:
 	Status set(const string& key, const string& value);
 	Status get(const string& key, string& value);
 	Status del(const string& key);
+	void counts(uint64_t& hits, uint64_t& misses);
 private:	
 	pthread_mutex_t _lock;
 	uint32_t _capacity;
 	uint32_t _size;
+	uint64_t _hits, _misses;		// of get, guarded by _lock
 	Node *head, *tail;
 	unordered_map<string, Node*> table;
 
-	void lock() { pthread_mutex_lock(&_lock); }
+	void lock() {
+		if (pthread_mutex_trylock(&_lock) != 0) {
+			uint64_t start = Trace::begin();
+			pthread_mutex_lock(&_lock);
+			Trace::end(STAGE_CACHE_LOCK, start);
+		}
+	}
 	void unlock() { pthread_mutex_unlock(&_lock); }
 	void pop(Node* n);
 	void put_front(Node* n);
@@ -132,28 +291,66 @@ private:
 
 class DB {
 	friend class Debugger;
+	friend class Iterator;
 public:
 	DB();
 	~DB();
-	Status open(const string& dbname);
+	Status open(const string& dbname, const Options& opts = Options());
 	Status set(const string& key, const string& value);
 	Status get(const string& key, string& value);
+	Status get(const string& key, string& value, uint64_t& version);
+	Status get(const string& key, string& value, const Snapshot* snapshot);
 	Status del(const string& key);
+	Status write(WriteBatch& batch);
+
+	// atomic read-modify-write, executed under the stripe lock of the key
+	Status incrby(const string& key, int64_t delta, int64_t& result);
+	Status append(const string& key, const string& suffix, uint64_t& length);
+	Status cas(const string& key, uint64_t version, const string& value, uint64_t& current);
 	Status merge();
-	string exec(const string& cmd);
+
+	// value is left empty and current equals version if the key still has that version
+	Status getIfModified(const string& key, uint64_t version, string& value, uint64_t& current);
+
+	// values streamed in and out in pieces, without holding them whole
+	Status beginUpload(const string& key, uint64_t size, uint64_t& token);
+	Status writeChunk(uint64_t token, const char* buf, size_t len, uint64_t& received);
+	Status abortUpload(uint64_t token);
+	bool uploading(uint64_t token);		// begun and neither committed nor aborted
+	Status getRange(const string& key, uint64_t offset, uint64_t length, string& value);
+	Status valueSize(const string& key, uint64_t& size);
+
+	// consistent point-in-time view, data files it may read are kept until release
+	const Snapshot* getSnapshot();
+	void releaseSnapshot(const Snapshot* snapshot);
+
+	string exec(string_view cmd);
+	bool tryExec(string_view cmd, string& res);	// false unless cmd is a read served from memory
+	string exec(string_view cmd, FileRange& range);	// a large get value may come back as range
+	static bool readOnly(string_view cmd);
+	void stats(DBStats& st);
 	Status close();
 private:
 	FileLock* lock;		// so that another process is denied from read/write this database
 	pthread_rwlock_t _disk_lock;		// protect disk
+	atomic<uint64_t> disk_waits, disk_wait_ns;		// only touched when the lock is contended
+	atomic<uint64_t> merges, merge_moved;
+	atomic<bool> merging;
 
 	string dbname;
+	Options options;
 	Map _index;	// index
 	Cache cache;							// cache
 
 	// active data file
-	uint32_t active_id;
+	atomic<uint32_t> active_id;		// read without _disk_lock to tell sealed files
 	uint64_t active_size;
-	ofstream active_ofs;
+	DataFile active;
+
+	// next data file, created in background so that rollover never waits
+	DataFile next;
+	pthread_t next_pid;
+	bool next_pending;
 
 	// hint file
 	uint32_t hint_id;
@@ -162,41 +359,117 @@ private:
 
 	Env* env;
 
+	uint64_t last_seq;		// guarded by _disk_lock, never handed out twice, even across merge and restart
+
+	// live snapshots and data files waiting for them, guarded by _snap_lock
+	pthread_mutex_t _snap_lock;
+	multiset<uint64_t> snapshots;
+	vector<pair<uint32_t, uint64_t>> obsolete;		// data file id, seq when merged away
+
+	// uploads in progress, guarded by _upload_lock
+	pthread_mutex_t _upload_lock;
+	unordered_map<uint64_t, Upload> uploads;
+	uint64_t upload_seq;
+
 	// lock disk
 	Status disk_rdlock();
 	Status disk_wrlock();
 	Status disk_unlock();
 
 	Status init();
+	Status putRecord(const string& key, const string& value, uint64_t& seq);
+	Status delRecord(const string& key);
+	Status readRecord(const string& key, string& value, uint64_t& version);
+	bool memGet(const string& key, string& value, Index& index, Status& s);
+	Status readData(const Index& index, string& value);
+	bool inlinable(const string& value);
+	bool sealed(uint32_t id);
+	bool relocated(Index& index, Status& s);
+	Status moveRecord(const Index& old);
+	Status commitUpload(const Upload& upload);
+	Status openValue(Index& index, int& fd, uint64_t& pos, uint32_t& val_size);
+	Status readRange(Index& index, uint64_t offset, uint64_t length, string& value, uint64_t& size);
+	void removeObsolete();
+	Data makeData(const string& key, const string& value, time_t ts);
 	Status newFileStream(ofstream& fs, uint32_t& id, uint64_t& size, const string& dir, const string& filename);
+	Status newHintFile();		// open hint file hint_id, with its header if it is new, caller holds _disk_lock
+	Status mapDataFile(uint32_t id, uint64_t capacity, DataFile& file, uint64_t& end);
+	void unmapDataFile(DataFile& file, uint64_t end);
+	Status sealDataFile(uint32_t id);
+	Status rollData(uint64_t need);
+	void prepareNext();
+	static void* prepare(void* arg);
 	uint64_t syncData(const Data& data);
 	Status syncIndex(const Index& index);
+	uint64_t appendData(const string& buf);
+	Status appendIndex(const string& buf);
+	void encodeData(const Data& data, string& buf);
+	void encodeIndex(const Index& index, string& buf);
 	Status retrieve(const string& key, const uint32_t id, const uint64_t offset, time_t& time_stamp, string& value);
-	Status loadIndex(const string& filename);
+	Status loadIndex(const string& filename, uint32_t& version);
+	void loadBaseline(istream& is);
+	Status loadBatch(istream& is);
+	bool readIndex(istream& is, Index& index);
+};
+
+
+/**
+ * Iterator
+ *
+ * walk the keys of a snapshot, one bucket is copied at a time
+ */
+
+class Iterator {
+public:
+	Iterator(DB* d, const Snapshot* snapshot);
+	bool valid() { return pos < entries.size(); }
+	void next();
+	const string& key() { return entries[pos].key; }
+	const Index& index() { return entries[pos]; }
+	Status value(string& value);
+private:
+	DB* db;
+	uint64_t seq;
+	uint32_t bucketno;
+	vector<Index> entries;
+	size_t pos;
+
+	void fill();	// move to the next non-empty bucket
 };
 
 
 /**
  * Status
  *
- * show message if error occurs
+ * show message if error occurs. A literal message is only pointed to, so
+ * statuses on hot paths cost no allocation; built messages are kept.
  */
 
 class Status {
 public:
-	Status() : code(cOk) {}
+	Status() : code(cOk), text("") {}
 	bool ok() { return code == cOk; }
 	bool IsNotFound() { return code == cNotFound; }
 	bool IsIOError() { return code == cIOError; }
-	string toString() { return msg; }
+	bool IsInvalidArgument() { return code == cInvalidArgument; }
+	bool IsConflict() { return code == cConflict; }
+	string toString() { return msg.empty() ? string(text) : msg; }
 	Status Ok() { return Status(); }
 	Status NotFound(const string& msg) { return Status(cNotFound, msg); }
 	Status IOError(const string& msg) { return Status(cIOError, msg); }
+	Status InvalidArgument(const string& msg) { return Status(cInvalidArgument, msg); }
+	Status Conflict(const string& msg) { return Status(cConflict, msg); }
+	Status NotFound(const char* text) { return Status(cNotFound, text); }		// text must be static
+	Status IOError(const char* text) { return Status(cIOError, text); }
+	Status InvalidArgument(const char* text) { return Status(cInvalidArgument, text); }
+	Status Conflict(const char* text) { return Status(cConflict, text); }
 private:
-	enum Code { cOk = 0, cNotFound = 1, cIOError = 2 };
+	enum Code { cOk = 0, cNotFound = 1, cIOError = 2, cInvalidArgument = 3, cConflict = 4 };
 	Code code;
+	const char* text;
 	string msg;
-	Status(Code c, const string& m) : code(c), msg(m) {}
+	Status(Code c, const string& m) : code(c), text(""), msg(m) {}
+	Status(Code c, const char* t) : code(c), text(t) {}
 };
 
 
@@ -245,6 +518,14 @@ public:
 	void ui();
 	void test_db();
 	void test_concurrency();
+	void test_batch();
+	void test_rmw();
+	void test_snapshot();
+	void test_disk_index();
+	void test_rollover();
+	void test_compression();
+	void test_stream();
+	void test_stats();
 	string genString();
 private:
 	DB db;
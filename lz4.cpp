@@ -0,0 +1,151 @@
+/**
+ * File: lz4.cpp
+ *
+ * A sequence is: token | literal length | literals | offset | match length
+ * where the token holds 4 bits of each length, 15 meaning more bytes follow.
+ * The last sequence has literals only.
+ */
+
+#include <cstring>
+#include <cstdint>
+#include "lz4.h"
+
+static const size_t MinMatch = 4;
+static const size_t LastLiterals = 5;		// the block always ends with literals
+static const size_t MatchFindLimit = 12;	// no match starts this close to the end
+static const int HashLog = 12;
+static const size_t MaxOffset = 65535;
+
+static uint32_t read32(const char* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hashSeq(uint32_t v) {
+	return (v * 2654435761u) >> (32 - HashLog);
+}
+
+static char* writeLength(char* op, size_t len) {
+	for (; len >= 255; len -= 255) {
+		*op++ = (char)255;
+	}
+	*op++ = (char)len;
+	return op;
+}
+
+static char* writeSequence(char* op, const char* anchor, size_t lit, size_t off, size_t mlen, bool last) {
+	char* token = op++;
+	*token = (char)((lit >= 15 ? 15 : lit) << 4);
+	if (lit >= 15) {
+		op = writeLength(op, lit - 15);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+	if (last) {
+		return op;
+	}
+
+	*op++ = (char)(off & 0xFF);
+	*op++ = (char)(off >> 8);
+	*token |= (char)(mlen >= 15 ? 15 : mlen);
+	if (mlen >= 15) {
+		op = writeLength(op, mlen - 15);
+	}
+	return op;
+}
+
+size_t lz4_compress(const char* src, size_t len, char* dst, size_t cap) {
+	int32_t table[1 << HashLog];
+	const char *ip = src, *anchor = src, *end = src + len;
+	char *op = dst, *oend = dst + cap;
+
+	memset(table, -1, sizeof(table));
+	if (len > MatchFindLimit) {
+		const char *mflimit = end - MatchFindLimit, *matchlimit = end - LastLiterals;
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip), h = hashSeq(seq);
+			int32_t ref = table[h];
+			table[h] = (int32_t)(ip - src);
+			if (ref < 0 || (size_t)(ip - src - ref) > MaxOffset || read32(src + ref) != seq) {
+				++ip;
+				continue;
+			}
+
+			const char *match = src + ref, *p = ip + MinMatch, *m = match + MinMatch;
+			while (p < matchlimit && *p == *m) {
+				++p;
+				++m;
+			}
+			size_t lit = ip - anchor, mlen = p - ip - MinMatch;
+			if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) {
+				return 0;
+			}
+			op = writeSequence(op, anchor, lit, ip - match, mlen, false);
+			ip = anchor = p;
+		}
+	}
+
+	size_t lit = end - anchor;
+	if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) {
+		return 0;
+	}
+	op = writeSequence(op, anchor, lit, 0, 0, true);
+	return op - dst;
+}
+
+static bool readLength(const unsigned char*& ip, const unsigned char* iend, size_t& len) {
+	unsigned char b;
+	do {
+		if (ip >= iend) {
+			return false;
+		}
+		b = *ip++;
+		len += b;
+	} while (b == 255);
+	return true;
+}
+
+bool lz4_decompress(const char* src, size_t len, char* dst, size_t raw) {
+	const unsigned char *ip = (const unsigned char*)src, *iend = ip + len;
+	char *op = dst, *oend = dst + raw;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && !readLength(ip, iend, lit)) {
+			return false;
+		}
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+			return false;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend) {		// last sequence
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return false;
+		}
+		size_t off = ip[0] | (ip[1] << 8), mlen = token & 15;
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst)) {
+			return false;
+		}
+		if (mlen == 15 && !readLength(ip, iend, mlen)) {
+			return false;
+		}
+		mlen += MinMatch;
+		if (mlen > (size_t)(oend - op)) {
+			return false;
+		}
+		const char* m = op - off;
+		for (size_t i = 0; i < mlen; ++i) {		// may overlap, copy forward
+			op[i] = m[i];
+		}
+		op += mlen;
+	}
+	return op == oend;
+}
@@ -0,0 +1,20 @@
+/**
+ * File: lz4.h
+ *
+ * Block compression in the LZ4 block format, written from the format
+ * description so that no external library is needed
+ */
+
+#ifndef LZ4_H_
+#define LZ4_H_
+
+#include <cstddef>
+
+// returns the compressed size, or 0 if the result would not fit in cap
+size_t lz4_compress(const char* src, size_t len, char* dst, size_t cap);
+
+// returns false if src is corrupted or doesn't expand to exactly raw bytes
+bool lz4_decompress(const char* src, size_t len, char* dst, size_t raw);
+
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * File: pool.cpp
+ */
+
+#include "pool.h"
+
+static __thread ThreadPool* current = nullptr;	// pool and queue of the calling worker
+static __thread int self = -1;
+
+ThreadPool::ThreadPool(int n) : queues(n), workers(n), pids(n), pending(0), next(0), stopped(false) {
+	_lock = PTHREAD_MUTEX_INITIALIZER;
+	_cond = PTHREAD_COND_INITIALIZER;
+	for (int i = 0; i < n; ++i) {
+		queues[i].lock = PTHREAD_MUTEX_INITIALIZER;
+		workers[i].pool = this;
+		workers[i].id = i;
+		workers[i].taken = 0;
+	}
+	for (int i = 0; i < n; ++i) {
+		pthread_create(&pids[i], nullptr, work, (void*)&workers[i]);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	pthread_mutex_lock(&_lock);
+	stopped = true;
+	pthread_cond_broadcast(&_cond);
+	pthread_mutex_unlock(&_lock);
+	for (auto& pid : pids) {
+		pthread_join(pid, nullptr);
+	}
+}
+
+/**
+ * a worker queues follow-up tasks on its own queue, where they stay hot
+ * in its cache unless another worker is idle; others spread round robin
+ */
+void ThreadPool::submit(const std::function<void()>& task, lane_t lane) {
+	int id = (current == this) ? self : (int)(next++ % queues.size());
+
+	pthread_mutex_lock(&queues[id].lock);
+	queues[id].tasks[lane].push_back(task);
+	pthread_mutex_unlock(&queues[id].lock);
+
+	pthread_mutex_lock(&_lock);
+	++pending;
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_lock);
+}
+
+bool ThreadPool::take(int id, std::function<void()>& task) {
+	int n = (int)queues.size();
+	bool share = ((workers[id].taken + 1) % BULKSHARE == 0);		// this turn looks at bulk first
+
+	for (int l = 0; l < LANES; ++l) {
+		int lane = share ? LANES - 1 - l : l;
+		for (int i = 0; i < n; ++i) {	// own queue first, then steal
+			Queue& q = queues[(id + i) % n];
+			std::deque<std::function<void()>>& tasks = q.tasks[lane];
+			pthread_mutex_lock(&q.lock);
+			if (!tasks.empty()) {
+				if (i == 0) {
+					task = std::move(tasks.front());
+					tasks.pop_front();
+				} else {
+					task = std::move(tasks.back());
+					tasks.pop_back();
+				}
+				--pending;
+				pthread_mutex_unlock(&q.lock);
+				++workers[id].taken;
+				return true;
+			}
+			pthread_mutex_unlock(&q.lock);
+		}
+	}
+	return false;
+}
+
+void* ThreadPool::work(void* arg) {
+	Worker* worker = (Worker*)arg;
+	ThreadPool* pool = worker->pool;
+	std::function<void()> task;
+
+	current = pool;
+	self = worker->id;
+	while (true) {
+		if (pool->take(worker->id, task)) {
+			task();
+			continue;
+		}
+		pthread_mutex_lock(&pool->_lock);
+		while (pool->pending <= 0 && !pool->stopped) {
+			pthread_cond_wait(&pool->_cond, &pool->_lock);
+		}
+		bool done = (pool->pending <= 0);		// stopped and nothing left
+		pthread_mutex_unlock(&pool->_lock);
+		if (done) {
+			return nullptr;
+		}
+	}
+}
@@ -0,0 +1,56 @@
+/**
+ * File: pool.h
+ *
+ * A fixed size, work-stealing thread pool. Every worker has its own
+ * queue; a worker that runs dry takes tasks from the others. Urgent tasks
+ * are run before any bulk task, from whichever queue holds them, except
+ * that every BULKSHARE-th task a worker takes is bulk if any is queued,
+ * so a steady stream of urgent tasks cannot starve the bulk lane.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <functional>
+
+#define BULKSHARE 8		// a worker takes at least one bulk task in this many
+
+class ThreadPool {
+public:
+	enum lane_t { URGENT = 0, BULK = 1, LANES = 2 };
+
+	ThreadPool(int n);
+	~ThreadPool();
+	void submit(const std::function<void()>& task, lane_t lane = BULK);
+private:
+	struct Queue {		// the owner runs the front in order, thieves take the back
+		pthread_mutex_t lock;
+		std::deque<std::function<void()>> tasks[LANES];
+	};
+	struct Worker {
+		ThreadPool* pool;
+		int id;
+		unsigned taken;		// tasks taken so far, for the bulk share
+	};
+
+	std::vector<Queue> queues;
+	std::vector<Worker> workers;
+	std::vector<pthread_t> pids;
+	std::atomic<int> pending;		// tasks queued, summed over all queues
+	std::atomic<unsigned> next;		// queue for the next task submitted from outside
+
+	// idle workers sleep here until something is submitted
+	pthread_mutex_t _lock;
+	pthread_cond_t _cond;
+	bool stopped;
+
+	bool take(int id, std::function<void()>& task);
+	static void* work(void* arg);
+};
+
+
+#endif
@@ -1,187 +1,651 @@
 /**
  * File press.cpp
  *
- * This file test the performance of server 
+ * This file test the performance of server
+ *
+ * Every thread drives its own connections with its own epoll, so threads
+ * share nothing but a few counters. With -D a connection keeps up to that
+ * many operations in flight, sent together and answered in order.
+ *
+ * A run first loads the key space, then runs the workload for a duration
+ * or a number of operations. Each operation is timed from its first
+ * request to its last reply into per-thread histograms, merged for the
+ * report.
+ *
+ * By default the loop is closed, a connection sends its next operation
+ * as soon as the last one is answered, so a slow server slows press down
+ * and hides its own stalls. With a target rate the loop is open: each
+ * thread schedules arrivals on its own clock, an arrival waits for a free
+ * connection if it must, and its latency counts from when it was due.
  */
 
 
 #include <unistd.h>
-#include <sys/file.h>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <cmath>
 #include <sys/epoll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <cstring>
-#include <sys/time.h>
+#include <time.h>
+#include <iomanip>
 #include <getopt.h>
-#include <unordered_map>
 #include "tcp.h"
 #include "epl.h"
-#include "kv.h"
 #include "protocol.h"
+#include "workload.h"
+#include "histogram.h"
+
+using std::vector;
 
-using std::unordered_map;
+#define DEFAULT_CONNS 100           // concurrency number
+#define DEFAULT_DURATION 10         // seconds, when no operation count is given
+#define EVENTSIZE 256
+#define DRAINTIME 10                // seconds to wait for replies once a phase is stopped
+
+enum format_t { TEXT = 0, CSV = 1, JSON = 2 };
+const double Percentiles[] = { 50, 90, 99, 99.9 };
+const char* PercentileNames[] = { "p50", "p90", "p99", "p99.9" };
+#define PERCENTILES 4
+
+
+struct Pending {    // an operation in flight
+    Op op;
+    size_t waiting;     // replies still due
+    uint64_t sent;      // ns, when it went out, or was due in an open loop
+};
 
-unordered_map<int, timeval> start_times, end_times;
-int op = 0;
+struct Conn {       // a connection and the operations in flight on it, oldest first
+    Processor proc;
+    std::deque<Pending> inflight;
+    string out;         // requests not sent yet
+    Conn(int fd) : proc(fd) {}
+};
 
-#define DEFAULT_USER_NUM 10000        // concurrency number
-#define DEFAULT_REQ_NUM 100          // request number 
-#define BUFSIZE 2048                // max message length 
-#define THREADNUM 9
+struct Shared {     // state of a phase, seen by all threads
+    std::atomic<uint64_t> loaded;       // next key number to load
+    std::atomic<int64_t> budget;        // operations left to start
+    std::atomic<bool> stop;
+    std::atomic<int> finished;          // threads
+    uint64_t started;                   // ns
+};
 
+struct Arg {        // one per thread
+    int epfd;
+    vector<Conn*> conns;
+    Generator* gen;
+    const Workload* workload;
+    Shared* shared;
+    bool loading;
+    uint32_t depth;             // operations in flight per connection
+    double rate;                // arrivals per second for this thread, 0 for a closed loop
+    bool poisson;               // or evenly spaced
+    std::mt19937_64 rng;
+    Histogram latency[OPS];     // ns
+    uint64_t misses[OPS];
+    uint64_t dropped;           // arrivals still waiting for a connection when the phase stopped
+    vector<uint64_t> timeline;  // operations completed in each second
+};
 
-struct Arg {
-    int epfd, nfds;
-    int *cur;
-    unordered_map<int, Processor*>* table;
-	unordered_map<int, int>* record;
-    pthread_mutex_t *_lock, *g_lock;
-    epoll_event* events;
+struct Result {     // a phase, merged over the threads
+    double secs, target;    // target rate, 0 for a closed loop
+    Histogram latency[OPS], all;
+    uint64_t misses[OPS];
+    uint64_t dropped;       // arrivals never sent, see Arg
+    vector<uint64_t> timeline;
 };
 
+
+static uint64_t now() {     // ns
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static bool missed(std::string_view reply) {   // the reply to a get of an absent key
+    return reply.compare(0, 4, "Key ") == 0 && reply.size() >= 10 && reply.compare(reply.size() - 10, 10, "not found.") == 0;
+}
+
+/** ns from one arrival to the next in an open loop **/
+static uint64_t gap(Arg* para) {
+    double mean = 1e9 / para->rate;
+    if (!para->poisson) {
+        return (uint64_t)mean;
+    }
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    return (uint64_t)(-log(1 - uniform(para->rng)) * mean);
+}
+
+/** put the next operation on a connection, false if the phase is over **/
+static bool start(Arg* para, Conn* conn, uint64_t due) {
+    Pending pending;
+    if (para->loading) {
+        uint64_t n = para->shared->loaded.fetch_add(1);
+        if (n >= para->workload->records) {
+            return false;
+        }
+        para->gen->load(pending.op, n);
+    } else {
+        if (para->shared->budget.fetch_sub(1) <= 0) {
+            return false;
+        }
+        para->gen->next(pending.op);
+    }
+
+    pending.sent = due ? due : now();
+    pending.waiting = pending.op.requests.size();
+    for (auto& req : pending.op.requests) {
+        Processor::frame(conn->out, req);
+    }
+    conn->inflight.push_back(std::move(pending));
+    return true;
+}
+
 /** request **/
 void* request(void* arg) {
     Arg *para = (Arg*)arg;
-	Debugger debugger;
-
-    while (*para->cur < para->nfds) {
-        if (pthread_mutex_trylock(para->_lock) == 0) {
-            if (*para->cur < para->nfds) {
-                epoll_event ev = para->events[(*para->cur)++];
-                pthread_mutex_unlock(para->_lock);
-                int sockfd = ev.data.fd;
-               
-				pthread_mutex_lock(para->g_lock);
-                if (sockfd > 0 && (ev.events & EPOLLIN)) {  // read 
-					int read_bytes;
-					Processor* proc;
-
-					if (para->table->count(sockfd)) {
-						proc = (*para->table)[sockfd];
-					} else {
-						pthread_mutex_unlock(para->g_lock);
-						continue;
-					}
-					if ((read_bytes = proc->read()) <= 0) {
-						exit(1);
-					}
-					while (proc->ready()) {
-						proc->request();
-						if (--((*para->record)[sockfd]) == 0) {
-							delete proc;
-							para->table->erase(sockfd);
-							para->record->erase(sockfd);
-							gettimeofday(&end_times[sockfd], nullptr);
-							break;
-						}
-					}
-                } else if (sockfd > 0 && (ev.events & EPOLLOUT)) {  // write 
-					gettimeofday(&start_times[sockfd], nullptr);
-                	for (int i = 0; i < DEFAULT_REQ_NUM; ++i) {
-						string k = debugger.genString(), v = debugger.genString();
-						switch (op) {
-							case 0:
-								(*para->table)[sockfd]->response("set " + k + " " + v);
-								break;
-							case 1:
-								(*para->table)[sockfd]->response("get " + k);
-								break;
-							case 2:
-								(*para->table)[sockfd]->response("del " + k);
-								break;
-							default:
-								std::cout << op << std::endl;
-								break;
-						}
-					}
-					addfd(para->epfd, sockfd, EPOLL_CTL_MOD, EPOLLIN | EPOLLET);
-				}
-				pthread_mutex_unlock(para->g_lock);
-            } else {
-                pthread_mutex_unlock(para->_lock);
+    Shared* shared = para->shared;
+    epoll_event events[EVENTSIZE];
+    vector<Conn*> idle, dirty;      // a connection is in idle once per free pipeline slot
+    std::deque<uint64_t> backlog;       // due times of arrivals waiting for a connection
+    uint64_t next = shared->started, deadline = UINT64_MAX;
+    size_t busy = 0;
+    bool over = false;      // no more operations start in this phase
+
+    for (uint32_t d = 0; d < para->depth; ++d) {     // spread over the connections first
+        for (auto it = para->conns.rbegin(); it != para->conns.rend(); ++it) {
+            if (!(*it)->proc.closed()) {
+                idle.push_back(*it);
+            }
+        }
+    }
+    while (!over || busy > 0) {
+        uint64_t t = now();
+        if (shared->stop && !over) {    // let the operations in flight finish
+            over = true;
+            deadline = t + (uint64_t)DRAINTIME * 1000000000;
+            if (para->rate > 0) {       // arrivals that were due but never sent, counted not timed
+                for (; next <= t; next += gap(para)) {
+                    backlog.push_back(next);
+                }
+                para->dropped += backlog.size();
+                backlog.clear();
+            }
+        }
+        if (t >= deadline) {
+            break;
+        }
+        if (!over && para->rate > 0) {
+            for (; next <= t; next += gap(para)) {
+                backlog.push_back(next);
+            }
+        }
+        while (!over && !idle.empty() && (para->rate == 0 || !backlog.empty())) {
+            Conn* conn = idle.back();
+            bool clean = conn->out.empty();
+            if (!start(para, conn, para->rate > 0 ? backlog.front() : 0)) {
+                over = true;
+                break;
+            }
+            if (clean) {
+                dirty.push_back(conn);
+            }
+            idle.pop_back();
+            ++busy;
+            if (para->rate > 0) {
+                backlog.pop_front();
+            }
+        }
+        size_t left = 0;    // a full socket keeps the rest until it is writable again
+        for (Conn* conn : dirty) {
+            if (conn->proc.transmit(conn->out) < 0) {
+                std::cerr << "Connection to server lost" << std::endl;
+                exit(1);
+            }
+            if (!conn->out.empty()) {
+                dirty[left++] = conn;
+            }
+        }
+        dirty.resize(left);
+        if (busy == 0 && idle.empty()) {     // every connection was lost
+            break;
+        }
+
+        int timeout = dirty.empty() ? 10 : 1;
+        if (dirty.empty() && !over && para->rate > 0 && backlog.empty()) {   // sleep until the next arrival
+            timeout = (int)((next - t + 999999) / 1000000);
+        }
+        int nfds = epoll_wait(para->epfd, events, EVENTSIZE, timeout);
+        for (int i = 0; i < nfds; ++i) {
+            Conn* conn = para->conns[events[i].data.u64 >> 32];
+            if (conn->proc.read() < 0 || conn->proc.closed()) {
+                std::cerr << "Connection to server lost" << std::endl;
+                exit(1);
+            }
+            while (conn->proc.ready() && !conn->inflight.empty()) {
+                std::string_view reply = conn->proc.request();
+                Pending& pending = conn->inflight.front();
+                if (missed(reply)) {
+                    ++para->misses[pending.op.type];
+                }
+                if (--pending.waiting == 0) {
+                    uint64_t t = now();
+                    size_t second = (t - para->shared->started) / 1000000000;
+                    para->latency[pending.op.type].record(t - pending.sent);
+                    if (para->timeline.size() <= second) {
+                        para->timeline.resize(second + 1, 0);
+                    }
+                    ++para->timeline[second];
+                    if (!para->loading) {
+                        para->gen->done(pending.op);
+                    }
+                    conn->inflight.pop_front();
+                    --busy;
+                    idle.push_back(conn);
+                }
             }
         }
     }
 
+    // replies still due could not be told from those of the next phase
+    for (Conn* conn : para->conns) {
+        if (!conn->inflight.empty()) {
+            conn->proc.disconnect();
+            conn->inflight.clear();
+        }
+    }
+    ++shared->finished;
     return nullptr;
 }
 
+/** run a phase on all threads and merge what they measured **/
+void phase(vector<Arg>& args, Shared& shared, bool loading, int64_t ops, uint32_t duration, double rate, Result& result) {
+    vector<pthread_t> pids(args.size());
+    size_t conns = 0;
+    for (auto& arg : args) {
+        conns += arg.conns.size();
+    }
 
-int main(int argc, char* argv[]) {
-    int nfds, epfd;
-    long double total_time = 0.0;
-    unordered_map<int, Processor*> table;
-	unordered_map<int, int> record;
-    pthread_t pids[THREADNUM];
-    pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
-    epoll_event events[DEFAULT_USER_NUM];
-
-
-    if (argc != 4) {
-        std::cout << "Usage: " << argv[0] << " <address> <port> <op>" << std::endl;
-        exit(1);
-    }
-
-	if (!strcmp(argv[3], "set")) {
-		op = 0;
-	} else if (!strcmp(argv[3], "get")) {
-		op = 1;
-	} else if (!strcmp(argv[3], "del")) {
-		op = 2;
-	} else {
-		std::cerr << "invalid op" << std::endl;
-		exit(1);
-	}
-
-    epfd = epoll_create1(0);    // create epoll 
-    for (int i = 0; i < DEFAULT_USER_NUM; ++i) {
-		int fd;
-        if ((fd = open_clientfd(argv[1], atoi(argv[2]))) < 0) {
-            std::cerr << "Connection to server failed" << std::endl;
-            exit(1);
+    shared.stop = false;
+    shared.finished = 0;
+    shared.budget = ops > 0 ? ops : INT64_MAX;
+    shared.started = now();
+    for (size_t i = 0; i < args.size(); ++i) {
+        args[i].loading = loading;
+        args[i].rate = rate * args[i].conns.size() / conns;     // shared out like the connections
+        for (int j = 0; j < OPS; ++j) {
+            args[i].latency[j].reset();
+            args[i].misses[j] = 0;
         }
-        setnonblock(fd);
-		addfd(epfd, fd, EPOLL_CTL_ADD, EPOLLOUT | EPOLLET);
-		table[fd] = new Processor(fd);
-		record[fd] = DEFAULT_REQ_NUM;
-		start_times[fd] = timeval();
-		end_times[fd] = timeval();
+        args[i].dropped = 0;
+        args[i].timeline.clear();
+        pthread_create(&pids[i], nullptr, request, (void*)&args[i]);
+    }
+    if (duration > 0) {
+        while (shared.finished < (int)args.size()) {
+            if (now() - shared.started >= (uint64_t)duration * 1000000000) {
+                shared.stop = true;
+                break;
+            }
+            usleep(10000);
+        }
+    }
+    for (size_t i = 0; i < args.size(); ++i) {
+        pthread_join(pids[i], nullptr);
     }
+    result.secs = (now() - shared.started) / 1e9;
+    result.target = rate;
 
-    // signals 
-    signal(SIGPIPE, SIG_IGN);
-    
+    for (int j = 0; j < OPS; ++j) {
+        result.latency[j].reset();
+        result.misses[j] = 0;
+    }
+    result.all.reset();
+    result.dropped = 0;
+    result.timeline.clear();
+    for (auto& arg : args) {
+        result.dropped += arg.dropped;
+        for (int j = 0; j < OPS; ++j) {
+            result.latency[j].merge(arg.latency[j]);
+            result.all.merge(arg.latency[j]);
+            result.misses[j] += arg.misses[j];
+        }
+        if (result.timeline.size() < arg.timeline.size()) {
+            result.timeline.resize(arg.timeline.size(), 0);
+        }
+        for (size_t s = 0; s < arg.timeline.size(); ++s) {
+            result.timeline[s] += arg.timeline[s];
+        }
+    }
+}
 
-    // main loop
-	struct timeval start, end;
-	gettimeofday(&start, nullptr);
-    while (true) {
-        nfds = epoll_wait(epfd, events, DEFAULT_USER_NUM, -1);
-        int id = 0;
-        pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
-        Arg arg = { epfd, nfds, &id, &table, &record, &_lock, &g_lock, events };
+/** latencies in us, one row per operation type and one for all **/
+void report(const Result& result, format_t format, const string& header) {
+    std::cout << std::fixed << std::setprecision(1);
+    const Histogram* rows[OPS + 1];
+    string names[OPS + 1];
+    int n = 0;
+    for (int i = 0; i < OPS; ++i) {
+        if (result.latency[i].count() > 0) {
+            rows[n] = &result.latency[i];
+            names[n++] = OpNames[i];
+        }
+    }
+    rows[n] = &result.all;
+    names[n++] = "all";
 
-        for (int i = 0; i < THREADNUM; ++i) {
-            pthread_create(&pids[i], nullptr, request, (void*)&arg);
+    if (format == CSV) {
+        std::cout << "op,count,not_found,mean_us";
+        for (int j = 0; j < PERCENTILES; ++j) {
+            std::cout << "," << PercentileNames[j] << "_us";
+        }
+        std::cout << ",max_us" << std::endl;
+        for (int i = 0; i < n; ++i) {
+            uint64_t misses = 0;
+            for (int j = 0; j < OPS; ++j) {
+                misses += (names[i] == OpNames[j] || names[i] == "all") ? result.misses[j] : 0;
+            }
+            std::cout << names[i] << "," << rows[i]->count() << "," << misses << "," << rows[i]->mean() / 1000;
+            for (double p : Percentiles) {
+                std::cout << "," << rows[i]->percentile(p) / 1000.0;
+            }
+            std::cout << "," << rows[i]->max() / 1000.0 << std::endl;
+        }
+        if (result.target > 0) {
+            std::cout << std::endl << "dropped_arrivals" << std::endl << result.dropped << std::endl;
+        }
+        std::cout << std::endl << "second,ops" << std::endl;
+        for (size_t s = 0; s < result.timeline.size(); ++s) {
+            std::cout << s << "," << result.timeline[s] << std::endl;
+        }
+    } else if (format == JSON) {
+        std::cout << "{\"seconds\": " << std::setprecision(3) << result.secs << std::setprecision(1) << ", \"ops\": " << result.all.count()
+                  << ", \"throughput\": " << (uint64_t)(result.all.count() / result.secs) << ", \"latency_us\": {";
+        for (int i = 0; i < n; ++i) {
+            std::cout << (i ? ", " : "") << "\"" << names[i] << "\": {\"count\": " << rows[i]->count()
+                      << ", \"mean\": " << rows[i]->mean() / 1000;
+            for (int j = 0; j < PERCENTILES; ++j) {
+                std::cout << ", \"" << PercentileNames[j] << "\": " << rows[i]->percentile(Percentiles[j]) / 1000.0;
+            }
+            std::cout << ", \"max\": " << rows[i]->max() / 1000.0 << "}";
+        }
+        std::cout << "}, \"not_found\": {";
+        for (int j = 0, first = 1; j < OPS; ++j) {
+            if (result.misses[j] > 0) {
+                std::cout << (first ? "" : ", ") << "\"" << OpNames[j] << "\": " << result.misses[j];
+                first = 0;
+            }
+        }
+        std::cout << "}, \"dropped_arrivals\": " << result.dropped << ", \"timeline\": [";
+        for (size_t s = 0; s < result.timeline.size(); ++s) {
+            std::cout << (s ? ", " : "") << result.timeline[s];
+        }
+        std::cout << "]}" << std::endl;
+    } else {
+        std::cout << header << ": " << result.all.count() << " ops in " << std::setprecision(3) << result.secs << "s, "
+                  << (uint64_t)(result.all.count() / result.secs) << " ops/s" << std::setprecision(1) << std::endl;
+        std::cout << "  " << std::left << std::setw(8) << "us" << std::right << std::setw(10) << "count" << std::setw(10) << "mean";
+        for (int j = 0; j < PERCENTILES; ++j) {
+            std::cout << std::setw(10) << PercentileNames[j];
+        }
+        std::cout << std::setw(10) << "max" << std::endl;
+        for (int i = 0; i < n; ++i) {
+            std::cout << "  " << std::left << std::setw(8) << names[i] << std::right << std::setw(10) << rows[i]->count()
+                      << std::setw(10) << rows[i]->mean() / 1000;
+            for (double p : Percentiles) {
+                std::cout << std::setw(10) << rows[i]->percentile(p) / 1000.0;
+            }
+            std::cout << std::setw(10) << rows[i]->max() / 1000.0 << std::endl;
         }
+        for (int j = 0; j < OPS; ++j) {
+            if (result.misses[j] > 0) {
+                std::cout << "  " << OpNames[j] << ": " << result.misses[j] << " keys not found" << std::endl;
+            }
+        }
+        if (result.dropped > 0) {
+            std::cout << "  " << result.dropped << " arrivals still waiting for a connection at the stop, not in the latencies" << std::endl;
+        }
+        std::cout << "  ops each second:";
+        for (uint64_t ops : result.timeline) {
+            std::cout << " " << ops;
+        }
+        std::cout << std::endl;
+    }
+}
 
-        for (int i = 0; i < THREADNUM; ++i) {
-            pthread_join(pids[i], nullptr);
+/** throughput and latency at each target rate of a sweep, in us **/
+void curve(const vector<Result>& steps, format_t format, bool poisson) {
+    std::cout << std::fixed << std::setprecision(1);
+    if (format == CSV) {
+        std::cout << "target,achieved,dropped,mean_us";
+        for (int j = 0; j < PERCENTILES; ++j) {
+            std::cout << "," << PercentileNames[j] << "_us";
         }
+        std::cout << ",max_us" << std::endl;
+    } else if (format == JSON) {
+        std::cout << "{\"arrivals\": \"" << (poisson ? "poisson" : "constant") << "\", \"sweep\": [";
+    } else {
+        std::cout << "Sweep, " << (poisson ? "poisson" : "constant") << " arrivals, latency from when each operation was due" << std::endl;
+        std::cout << "  " << std::setw(10) << "target" << std::setw(10) << "achieved" << std::setw(10) << "dropped" << std::setw(10) << "mean";
+        for (int j = 0; j < PERCENTILES; ++j) {
+            std::cout << std::setw(10) << PercentileNames[j];
+        }
+        std::cout << std::setw(10) << "max" << std::endl;
+    }
 
-        if (table.empty()) break;
+    for (size_t i = 0; i < steps.size(); ++i) {
+        const Histogram& all = steps[i].all;
+        uint64_t achieved = (uint64_t)(all.count() / steps[i].secs);
+        if (format == CSV) {
+            std::cout << (uint64_t)steps[i].target << "," << achieved << "," << steps[i].dropped << "," << all.mean() / 1000;
+            for (int j = 0; j < PERCENTILES; ++j) {
+                std::cout << "," << all.percentile(Percentiles[j]) / 1000.0;
+            }
+            std::cout << "," << all.max() / 1000.0 << std::endl;
+        } else if (format == JSON) {
+            std::cout << (i ? ", " : "") << "{\"target\": " << (uint64_t)steps[i].target << ", \"achieved\": " << achieved
+                      << ", \"dropped\": " << steps[i].dropped << ", \"mean\": " << all.mean() / 1000;
+            for (int j = 0; j < PERCENTILES; ++j) {
+                std::cout << ", \"" << PercentileNames[j] << "\": " << all.percentile(Percentiles[j]) / 1000.0;
+            }
+            std::cout << ", \"max\": " << all.max() / 1000.0 << "}";
+        } else {
+            std::cout << "  " << std::setw(10) << (uint64_t)steps[i].target << std::setw(10) << achieved << std::setw(10) << steps[i].dropped
+                      << std::setw(10) << all.mean() / 1000;
+            for (int j = 0; j < PERCENTILES; ++j) {
+                std::cout << std::setw(10) << all.percentile(Percentiles[j]) / 1000.0;
+            }
+            std::cout << std::setw(10) << all.max() / 1000.0 << std::endl;
+        }
     }
-	gettimeofday(&end, nullptr);
+    if (format == JSON) {
+        std::cout << "]}" << std::endl;
+    }
+}
+
+/** ops/s from "5000", or "50/conn" for each connection **/
+static double parseRate(const char* spec, uint32_t conns) {
+    return strstr(spec, "/conn") ? atof(spec) * conns : atof(spec);
+}
 
-	for (auto& p : start_times) {
-		int fd = p.first;
-		timeval st = p.second, et = end_times[fd];
-		total_time += ((et.tv_sec - st.tv_sec) * 1000 + (et.tv_usec - st.tv_usec) / 1000);
-	}
-	std::cout << "Time: " << (end.tv_sec - start.tv_sec + (double)(end.tv_usec - start.tv_usec) / 1000000) << "s" << std::endl;
-	std::cout << "Avg: " << ((end.tv_sec - start.tv_sec) * 1000 + (double)(end.tv_usec - start.tv_usec) / 1000) / (DEFAULT_USER_NUM * DEFAULT_REQ_NUM) << "ms" << std::endl;
-	std::cout << "Avg time per request: " << (total_time / (DEFAULT_USER_NUM * DEFAULT_REQ_NUM)) << "ms" << std::endl;
+void usage(char* name) {
+    std::cerr << "Usage: " << name << " [-w a..f] [-p read=.5,update=.5,insert=0,scan=0,rmw=0] [-k uniform|zipfian|latest]" << std::endl
+              << "       [-r records] [-s bytes|min-max|zipfian:min-max] [-e max_scan] [-c conns] [-t threads]" << std::endl
+              << "       [-d seconds] [-n ops] [-L] [-o text|csv|json] [-D depth]" << std::endl
+              << "       [-R rate[/conn]] [-a constant|poisson] [-S from-to:step[/conn]] <address> <port>" << std::endl;
+    exit(1);
+}
+
+
+int main(int argc, char* argv[]) {
+    Workload workload;
+    string mix, dist;
+    uint32_t conns = DEFAULT_CONNS, threads = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN), duration = 0;
+    int64_t ops = 0;
+    bool load = true;
+    format_t format = TEXT;
+    const char *rate_spec = nullptr, *sweep_spec = nullptr;
+    bool poisson = false;
+    uint32_t depth = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:p:k:r:s:e:c:t:d:n:Lo:R:a:S:D:")) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 'w':
+                ok = workload.preset(optarg);
+                break;
+            case 'p':
+                mix = optarg;       // applied after the preset, whatever the order
+                break;
+            case 'k':
+                dist = optarg;
+                break;
+            case 'r':
+                workload.records = strtoull(optarg, nullptr, 10);
+                ok = workload.records > 0;
+                break;
+            case 's':
+                ok = workload.setSize(optarg);
+                break;
+            case 'e':
+                workload.max_scan = (uint32_t)atoi(optarg);
+                ok = workload.max_scan > 0;
+                break;
+            case 'c':
+                conns = (uint32_t)atoi(optarg);
+                ok = conns > 0;
+                break;
+            case 't':
+                threads = (uint32_t)atoi(optarg);
+                ok = threads > 0;
+                break;
+            case 'd':
+                duration = (uint32_t)atoi(optarg);
+                break;
+            case 'n':
+                ops = atoll(optarg);
+                break;
+            case 'L':       // the keys are there from an earlier run
+                load = false;
+                break;
+            case 'o':
+                format = !strcmp(optarg, "csv") ? CSV : !strcmp(optarg, "json") ? JSON : TEXT;
+                ok = format != TEXT || !strcmp(optarg, "text");
+                break;
+            case 'R':       // open loop at this rate
+                rate_spec = optarg;
+                ok = atof(optarg) > 0;
+                break;
+            case 'a':
+                poisson = !strcmp(optarg, "poisson");
+                ok = poisson || !strcmp(optarg, "constant");
+                break;
+            case 'D':
+                depth = (uint32_t)atoi(optarg);
+                ok = depth > 0;
+                break;
+            case 'S':       // open loop at each rate in turn
+                sweep_spec = optarg;
+                ok = atof(optarg) > 0 && strchr(optarg, '-') && strchr(optarg, ':');
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            usage(argv[0]);
+        }
+    }
+    if ((!mix.empty() && !workload.setMix(mix)) || (!dist.empty() && !workload.setDist(dist))) {
+        usage(argv[0]);
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+    if (duration == 0 && ops == 0) {
+        duration = DEFAULT_DURATION;
+    }
+    threads = std::min(threads, conns);
+
+    vector<double> rates;
+    if (sweep_spec) {
+        double from = parseRate(sweep_spec, conns), to = parseRate(strchr(sweep_spec, '-') + 1, conns);
+        double step = parseRate(strchr(sweep_spec, ':') + 1, conns);
+        if (step <= 0 || to < from) {
+            usage(argv[0]);
+        }
+        for (double rate = from; rate <= to * (1 + 1e-9); rate += step) {
+            rates.push_back(rate);
+        }
+    } else {
+        rates.push_back(rate_spec ? parseRate(rate_spec, conns) : 0);
+    }
+
+    // signals
+    signal(SIGPIPE, SIG_IGN);
+
+    // connections, dealt out to the threads
+    Shared shared;
+    KeySpace keys;
+    keys.next = workload.records;
+    keys.pending = 0;
+    vector<Arg> args(threads);
+    for (uint32_t i = 0; i < threads; ++i) {
+        args[i] = Arg();
+        args[i].epfd = epoll_create1(0);
+        args[i].gen = new Generator(workload, &keys, time(nullptr) * 1000 + i);
+        args[i].workload = &workload;
+        args[i].shared = &shared;
+        args[i].poisson = poisson;
+        args[i].depth = depth;
+        args[i].rng.seed(time(nullptr) * 1000 + threads + i);
+    }
+    for (uint32_t i = 0; i < conns; ++i) {
+        int fd;
+        if ((fd = open_clientfd(argv[optind], atoi(argv[optind + 1]))) < 0) {
+            std::cerr << "Connection to server failed" << std::endl;
+            exit(1);
+        }
+        setnonblock(fd);
+        Arg& arg = args[i % threads];
+        addfd(arg.epfd, fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT | EPOLLET, (uint32_t)arg.conns.size());
+        arg.conns.push_back(new Conn(fd));
+    }
+
+    // progress goes to stderr when stdout is for a machine
+    std::ostream& info = (format == TEXT) ? std::cout : std::cerr;
+    info << "Workload: " << workload.describe() << ", " << conns << " connections on " << threads << " threads, depth " << depth << std::endl;
+    Result result;
+    if (load) {
+        shared.loaded = 0;
+        phase(args, shared, true, 0, 0, 0, result);
+        info << "Load: " << workload.records << " records in " << result.secs << "s, "
+             << (uint64_t)(workload.records / result.secs) << " ops/s" << std::endl;
+    }
+
+    if (!sweep_spec) {
+        phase(args, shared, false, ops, duration, rates[0], result);
+        string header = "Run";
+        if (rates[0] > 0) {
+            header += " at " + std::to_string((uint64_t)rates[0]) + " ops/s " + (poisson ? "poisson" : "constant");
+        }
+        report(result, format, header);
+        return 0;
+    }
+
+    vector<Result> steps(rates.size());
+    for (size_t i = 0; i < rates.size(); ++i) {
+        phase(args, shared, false, ops, duration, rates[i], steps[i]);
+        info << "Step " << (uint64_t)rates[i] << " ops/s: " << (uint64_t)(steps[i].all.count() / steps[i].secs) << " ops/s achieved" << std::endl;
+    }
+    curve(steps, format, poisson);
 
     return 0;
 }
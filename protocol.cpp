@@ -4,71 +4,118 @@
 
 #include "protocol.h"
 
+/**
+ * messages handed out by request point into content, so it is only
+ * compacted here, once per read instead of once per message. Data is
+ * received straight into its spare room. With max_frame set, reading
+ * stops once a whole message of the largest size is buffered, and the
+ * caller reads again after handing out what is ready, see drained.
+ */
 int Processor::read() {
-	int total = 0, nread, read_bytes = 0;
-	char buf[TEMPSIZE + 1] = { 0 };
+	int nread, read_bytes = 0;
 
-	while ((nread = (int)recv(connfd, buf + total, (size_t)(TEMPSIZE - total), 0)) > 0) {
-		total += nread;
-		read_bytes += nread;
-		if (total >= TEMPSIZE) {
-			content.append(buf, total);
-			memset(buf, 0, sizeof(buf));
-			total = 0;
+	content.erase(0, consumed);
+	consumed = 0;
+	_drained = true;
+	while (true) {
+		size_t used = content.size();
+		if (max_frame && used >= sizeof(int) + max_frame) {
+			_drained = false;
+			return read_bytes;
 		}
+		content.resize(used + TEMPSIZE);	// keeps its capacity when shrunk back
+		nread = (int)recv(connfd, &content[used], TEMPSIZE, 0);
+		content.resize(used + (nread > 0 ? nread : 0));
+		if (nread <= 0) {
+			break;
+		}
+		read_bytes += nread;
 	}
 	if (nread < 0 && errno != EAGAIN) {
 		perror("read");
 		close(connfd);
+		_closed = true;
 		return -1;
 	}
 	if (nread == 0) {
 		close(connfd);
+		_closed = true;
 		return 0;
 	} else {
-		content.append(buf, total);
 		return read_bytes;
 	}
 }
 
 int Processor::getRequestSize() {
-	if (content.size() < 4) {
+	if (content.size() - consumed < 4) {
 		return -1;
 	} else {
-		return *(int*)&content[0];
+		int size;
+		memcpy(&size, &content[consumed], sizeof(size));
+		return size;
+	}
+}
+
+bool Processor::oversized() {
+	uint32_t size;
+	if (content.size() - consumed < sizeof(size)) {
+		return false;
 	}
+	memcpy(&size, &content[consumed], sizeof(size));
+	return size > INT_MAX || (max_frame && size > max_frame);
 }
 
 bool Processor::ready() {
 	int req_size = getRequestSize();
-	if (req_size == -1) {
+	if (req_size == -1 || oversized()) {
 		return false;
 	} else {
-		return (content.size() >= sizeof(int) + req_size);
+		return (content.size() - consumed >= sizeof(int) + req_size);
 	}
 }
 
-string Processor::request() {
+std::string_view Processor::request() {
 	int req_size = getRequestSize();
-	string req = content.substr(4, req_size);
-	content.erase(content.begin(), content.begin() + 4 + req_size);
+	std::string_view req(content.data() + consumed + 4, req_size);
+	consumed += 4 + req_size;
 	return req;
 }
 
 int Processor::response(const string& res){
-	const char *ptr = res.c_str();
-	int left = (int)res.length(), nwrite;
+	frame(pending, res);
+	return transmit(pending);
+}
+
+void Processor::frame(string& buf, const string& msg) {
+	int size = (int)msg.length();
+	buf.append((char*)&size, 4);
+	buf.append(msg);
+}
 
-	send(connfd, (char*)&left, 4, 0);
-	while (left > 0) {
-		nwrite = (int)send(connfd, ptr, (size_t)left, 0);
+int Processor::transmit(string& buf) {
+	size_t sent = 0;
+	ssize_t nwrite;
+
+	while (sent < buf.size()) {
+		nwrite = send(connfd, buf.data() + sent, buf.size() - sent, 0);
+		if (nwrite < 0 && errno == EAGAIN) {
+			break;
+		}
 		if (nwrite <= 0) {
 			perror("write");
 			close(connfd);
+			_closed = true;
 			return -1;
 		}
-		left -= nwrite;
-		ptr += nwrite;
+		sent += nwrite;
+	}
+	buf.erase(0, sent);
+	return (int)sent;
+}
+
+void Processor::disconnect() {
+	if (!_closed) {
+		close(connfd);
+		_closed = true;
 	}
-	return 0;
 }
@@ -7,6 +7,8 @@
 
 #include <iostream>
 #include <cstring>
+#include <string_view>
+#include <climits>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -18,14 +20,27 @@ using std::string;
 class Processor {	// catch the whole request
 public:
 	Processor() = default;
-	Processor(int fd) : connfd(fd), content("") {}
+	Processor(int fd, size_t max = 0) : connfd(fd), content(""), consumed(0), max_frame(max), _drained(true), _closed(false) {}
 	int read();
 	bool ready();
-	string request();		// get response from client
-	int response(const string& res);	// send response to client
+	bool oversized();		// the next message announces more than max_frame bytes
+	bool drained() { return _drained; }		// read stopped at EAGAIN, not at max_frame
+	std::string_view request();		// the next message, valid until the next read
+	int response(const string& res);	// queue a message and send what the socket takes now
+	int flush() { return transmit(pending); }	// once writable, send what response left queued
+	static void frame(string& buf, const string& msg);	// append msg as the wire carries it
+	int transmit(string& buf);	// framed messages, as much as the socket takes now, the rest stays
+	void disconnect();
+	int fd() { return connfd; }
+	bool closed() { return _closed; }	// by the peer or after an error
 private:
 	int connfd;
 	string content;
+	size_t consumed;		// bytes of content already handed out
+	size_t max_frame;		// longest message accepted, 0 for no limit
+	bool _drained;
+	string pending;			// framed messages the socket has not taken yet
+	bool _closed;
 	
 	int getRequestSize();
 };
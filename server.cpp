@@ -8,29 +8,136 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
-#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <memory>
 #include <atomic>
+#include <getopt.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
 #include "tcp.h"
 #include "epl.h"
 #include "protocol.h"
 #include "kv.h"
+#include "pool.h"
+#include "coro.h"
+#include "timer.h"
+#include "stats.h"
 
 #define DEBUG false         // for debug 
 #define SPEEDUP true        // cancel sync with stdio, be careful with this 
 #define DETAILED false      // print out detailed content 
 
-using std::unordered_map;
 
 /* Macro definitions */
 #define DEFAULT_PORT 9000
 #define THREADSIZE 9
+#define EXECTHREADS 4       // least threads of the execution stage, one per core beyond
 #define BUFSIZE 2048
 #define EVENTSIZE 20000
+#define WHEELSIZE 512       // slots of the idle timer wheel, one per second
+#define DEFAULT_MAX_CONNS 65536
+#define DEFAULT_IDLE_TIMEOUT 300    // seconds
+#define MAXSLOTS (1 << 20)          // fds beyond this are refused
+#define DEFAULT_TRACE_SAMPLE 100    // one request in this many is traced through the engine
+#define OPENUPLOADS 16              // uploads a connection remembers before it drops the finished ones
+#define DEFAULT_MAX_FRAME (1 << 26) // bytes of the longest request, also of a chunk or range
 
 #define log(msg) (std::cout << (msg) << std::flush)
 #define err_log(msg) (std::cerr << (msg) << std::flush)
 
 
+/** A connection, shared by the coroutine serving it and the table **/
+
+struct Connection {
+	Processor proc;
+	Readiness readiness;
+	uint32_t gen;		// of its slot in the table when it was published
+	std::atomic<uint64_t> deadline;		// tick it is reaped at unless active again
+	std::atomic<bool> expired;
+	std::vector<uint64_t> uploads;		// tokens it began, aborted when it closes unless committed
+
+	Connection(int fd, size_t max_frame) : proc(fd, max_frame), gen(0), deadline(0), expired(false) {}
+};
+
+/**
+ * Live connections indexed by fd, preallocated for every fd the process
+ * may open. A slot is published with a release store and looked up with
+ * a single acquire load, no lock and no hashing. Its generation goes up
+ * with every connection on the fd and travels in the epoll event, so an
+ * event left over from an earlier connection on a reused fd is ignored.
+ * A connection taken out of its slot is kept alive until the serve
+ * threads that might have loaded it are joined.
+ */
+
+struct Slot {
+	std::atomic<Connection*> conn;
+	std::atomic<uint32_t> gen;
+};
+
+class Table {
+public:
+	Table(size_t n) : slots(new Slot[n]()), size(n), live(0) { _lock = PTHREAD_MUTEX_INITIALIZER; }
+	~Table() { delete[] slots; }
+
+	bool publish(int fd, const std::shared_ptr<Connection>& conn, uint32_t max_conns) {
+		if (fd < 0 || (size_t)fd >= size) {
+			return false;
+		}
+		if (live.fetch_add(1) >= max_conns) {
+			--live;
+			return false;
+		}
+		conn->gen = slots[fd].gen.fetch_add(1) + 1;
+		slots[fd].conn.store(conn.get(), std::memory_order_release);
+		return true;
+	}
+
+	Connection* lookup(int fd, uint32_t gen) {
+		if (fd < 0 || (size_t)fd >= size) {
+			return nullptr;
+		}
+		Connection* conn = slots[fd].conn.load(std::memory_order_acquire);
+		return (conn && conn->gen == gen) ? conn : nullptr;
+	}
+
+	void retire(int fd, const std::shared_ptr<Connection>& conn) {
+		Connection* expected = conn.get();
+		slots[fd].conn.compare_exchange_strong(expected, nullptr);
+		--live;
+		pthread_mutex_lock(&_lock);
+		retired.push_back(conn);
+		pthread_mutex_unlock(&_lock);
+	}
+
+	void reclaim() {	// only while no serve thread runs
+		std::vector<std::shared_ptr<Connection>> garbage;
+		pthread_mutex_lock(&_lock);
+		garbage.swap(retired);
+		pthread_mutex_unlock(&_lock);
+	}
+
+	uint32_t count() { return live.load(); }
+private:
+	Slot* slots;
+	size_t size;
+	std::atomic<uint32_t> live;
+
+	pthread_mutex_t _lock;
+	std::vector<std::shared_ptr<Connection>> retired;
+};
+
+struct Limits {		// set from the command line
+	uint32_t max_conns;
+	uint32_t idle_timeout;		// seconds, 0 disables reaping
+	uint32_t stats_interval;	// seconds between stats dumps to the log, 0 disables
+	int admin_port;		// serves /metrics over HTTP, 0 disables
+	uint32_t slow_us;		// requests slower than this are logged, 0 disables
+	uint32_t trace_sample;
+	uint32_t max_frame;		// longer requests are refused and their connection closed
+};
+
+
 /** This struct transfers parameters to threads **/
 
 struct Arg {
@@ -40,14 +147,31 @@ struct Arg {
     epoll_event* events;
     volatile int* cur;
     pthread_mutex_t *_lock;
-	unordered_map<int, Processor*>* table;
+	Table* table;
 	DB* db;
+	ThreadPool* pool;
+	TimerWheel<Connection>* wheel;
+	Limits* limits;
+	Stats* stats;
+	SlowLog* slow;
 };
 
+struct Admin {		// what the admin thread reads
+	int listenfd;
+	Table* table;
+	DB* db;
+	Stats* stats;
+};
 
-void initialize(int &port, int &listenfd, int &epfd, DB& db, int argc, char* argv[]);
-int parse(int& port, int argc, char* argv[]);
+
+void initialize(int &port, int &listenfd, int &epfd, DB& db, Limits& limits, int argc, char* argv[]);
+int parse(int& port, Options& options, Limits& limits, int argc, char* argv[]);
 void* serve(void* arg);    // create threads to deal with tasks 
+void* admin(void* arg);     // answer metrics scrapes, off the request path
+void reap(TimerWheel<Connection>& wheel, Stats& stats);
+Task handle(std::shared_ptr<Connection> conn, Table* table, DB* db, ThreadPool* pool, Limits* limits, Stats* stats, SlowLog* slow);
+Async<bool> sendAll(Connection* conn, const char* ptr, size_t left, int flags);
+Async<bool> sendFile(Connection* conn, int fd, off_t offset, size_t left);
 
 
 
@@ -55,8 +179,16 @@ int main(int argc, char* argv[]) {
     // viariables of socket and epoll 
     int port, listenfd, epfd, nfds;
 	DB db;
-	unordered_map<int, Processor*> table;
-    pthread_t pids[THREADSIZE];
+	ThreadPool pool(std::max(EXECTHREADS, (int)sysconf(_SC_NPROCESSORS_ONLN)));
+	rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	Table table(std::min((rlim_t)MAXSLOTS, rl.rlim_cur));
+	TimerWheel<Connection> wheel(WHEELSIZE);
+	Limits limits = { DEFAULT_MAX_CONNS, DEFAULT_IDLE_TIMEOUT, 0, 0, 0, DEFAULT_TRACE_SAMPLE, DEFAULT_MAX_FRAME };
+	Stats stats;
+	uint64_t dumped = 0;
+	std::atomic<bool> dumping(false);		// a dump still running on the pool skips the next
+    pthread_t pids[THREADSIZE], adminpid;
     epoll_event *events = (epoll_event*)malloc(EVENTSIZE * sizeof(epoll_event));
     
 
@@ -78,20 +210,46 @@ int main(int argc, char* argv[]) {
 #endif
 
     // initialize 
-    initialize(port, listenfd, epfd, db, argc, argv); 
+    initialize(port, listenfd, epfd, db, limits, argc, argv); 
+    SlowLog slow(limits.slow_us, limits.trace_sample);
+    Admin admin_arg = { -1, &table, &db, &stats };
+    if (limits.admin_port) {
+        if ((admin_arg.listenfd = open_listenfd(limits.admin_port)) < 0) {
+            err_log("Open admin listen fd failed\n");
+            exit(1);
+        }
+        pthread_create(&adminpid, nullptr, admin, (void*)&admin_arg);
+        pthread_detach(adminpid);
+        log("Success, metrics served on port " + std::to_string(limits.admin_port) + ".\n");
+    }
 
-    // main loop
+    // main loop, waking up every tick to reap idle connections and dump stats
     while (true) {
-        nfds = epoll_wait(epfd, events, EVENTSIZE, -1);
-        if (nfds < 0) {
+        nfds = epoll_wait(epfd, events, EVENTSIZE, (limits.idle_timeout || limits.stats_interval) ? 1000 : -1);
+        if (nfds < 0 && errno != EINTR) {
             perror("epoll_wait");
             exit(1);
         }
+        if (limits.idle_timeout) {
+            reap(wheel, stats);
+        }
+        if (limits.stats_interval && stats.uptime() >= dumped + limits.stats_interval) {
+            dumped = stats.uptime();
+            if (!dumping.exchange(true)) {      // report() reads the data directory, keep it off the event loop
+                pool.submit([&]() {
+                    log("--- stats ---\n" + stats.report(table.count(), db) + "\n");
+                    dumping = false;
+                }, ThreadPool::BULK);
+            }
+        }
+        if (nfds <= 0) {
+            continue;
+        }
         
         // arguments 
         volatile int i = 0;
         pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
-        Arg arg = { epfd, listenfd, nfds, events, &i, &_lock, &table , &db };
+        Arg arg = { epfd, listenfd, nfds, events, &i, &_lock, &table , &db, &pool, &wheel, &limits, &stats, &slow };
 
         for (int n = 0; n < THREADSIZE; ++n) {
             pthread_create(&pids[n], nullptr, serve, (void*)&arg);
@@ -99,15 +257,13 @@ int main(int argc, char* argv[]) {
         for (int n = 0; n < THREADSIZE; ++n) {
             pthread_join(pids[n], nullptr);
         }
+        table.reclaim();    // no thread can hold what was retired before now
 
 		//db.merge();	// TODO: judge whether to merge or not
     }
 
     free(events);
     close(epfd);
-	for (auto &_p : table) {
-		delete _p.second;
-	}
 	db.close();
 }
 
@@ -116,25 +272,75 @@ int main(int argc, char* argv[]) {
 /*************** Definitions ***************/
 
 
-int parse(int& port, int argc, char* argv[]) {
-    if (argc == 1) {
+int parse(int& port, Options& options, Limits& limits, int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:i:c:z:r:m:t:s:a:l:T:f:")) != -1) {
+        switch (opt) {
+            case 'k':   // disk resident keydir with the given primary pages
+                options.disk_index = true;
+                options.index_pages = (uint32_t)atoi(optarg);
+                break;
+            case 'i':   // values shorter than this are kept in the index
+                options.inline_size = (uint32_t)atoi(optarg);
+                break;
+            case 'c':   // values at least this long are compressed
+                options.compress_size = (uint32_t)atoi(optarg);
+                break;
+            case 'z':   // stored values at least this long are sent with sendfile
+                options.zero_copy_size = (uint32_t)atoi(optarg);
+                break;
+            case 'r':   // values at least this long are stored raw for ranged reads
+                options.stream_size = (uint32_t)atoi(optarg);
+                break;
+            case 'm':   // connections beyond this are closed right after accept
+                limits.max_conns = (uint32_t)atoi(optarg);
+                break;
+            case 't':   // seconds a connection may stay idle, 0 keeps it forever
+                limits.idle_timeout = (uint32_t)atoi(optarg);
+                break;
+            case 's':   // print the STATS report every this many seconds
+                limits.stats_interval = (uint32_t)atoi(optarg);
+                break;
+            case 'a':   // port of the HTTP listener for Prometheus
+                limits.admin_port = atoi(optarg);
+                break;
+            case 'l':   // microseconds past which a request goes to the slow log
+                limits.slow_us = (uint32_t)atoi(optarg);
+                break;
+            case 'T':   // trace one request in this many through the engine, 0 never
+                limits.trace_sample = (uint32_t)atoi(optarg);
+                break;
+            case 'f':   // longest request, chunk and range in bytes
+                limits.max_frame = (uint32_t)atoi(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-k index_pages] [-i inline_size] [-c compress_size] [-z zero_copy_size] [-r stream_size] [-m max_conns] [-t idle_timeout] [-s stats_interval] [-a admin_port] [-l slow_us] [-T trace_sample] [-f max_frame] <port>" << std::endl;
+                return 1;
+        }
+    }
+
+    if (optind == argc) {
         port = DEFAULT_PORT;
         return 0;
-    } else if (argc == 2) {
-        port = atoi(argv[1]);
+    } else if (optind + 1 == argc) {
+        port = atoi(argv[optind]);
         return 0;
     } else {
-        std::cerr << "Usage: " << argv[0] << " <port>" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [-k index_pages] [-i inline_size] [-c compress_size] [-z zero_copy_size] [-r stream_size] [-m max_conns] [-t idle_timeout] [-s stats_interval] [-a admin_port] [-l slow_us] [-T trace_sample] [-f max_frame] <port>" << std::endl;
         return 1;
     }
 }
 
-void initialize(int &port, int &listenfd, int &epfd, DB& db, int argc, char* argv[]) {
+void initialize(int &port, int &listenfd, int &epfd, DB& db, Limits& limits, int argc, char* argv[]) {
+    Options options;
+
     signal(SIGPIPE, SIG_IGN);
-    if (parse(port, argc, argv)) {
+    if (parse(port, options, limits, argc, argv)) {
         err_log("Error occurs when parsing command line arguments\n");
         exit(1);
     }
+    options.max_chunk = limits.max_frame;
 
     log("Initializing...\n");
     if ((listenfd = open_listenfd(port)) < 0) {
@@ -153,7 +359,7 @@ void initialize(int &port, int &listenfd, int &epfd, DB& db, int argc, char* arg
     log("Success, listenfd added to epoll.\n");
 
 	Status s;
-	s = db.open("db");
+	s = db.open("db", options);
 	if (!s.ok()) {
 		std::cout << s.toString() << std::endl;
 		exit(1);
@@ -172,42 +378,38 @@ void* serve(void *arg) {
     while (*para->cur < para->nfds) {
         if (pthread_mutex_trylock(para->_lock) == 0) {
             if (*para->cur < para->nfds) {  // check again, since it may have been changed by other thread 
-                epoll_event event = para->events[(*para->cur)++];
+                int cur = *para->cur;
+                *para->cur = cur + 1;     // guarded by _lock, ++ on volatile is deprecated
+                epoll_event event = para->events[cur];
                 pthread_mutex_unlock(para->_lock);
-                int sockfd = event.data.fd;
+                int sockfd = (int)(uint32_t)event.data.u64;
                 if (sockfd == para->listenfd) {     // if client connects 
                     sockaddr_in clientaddr;
                     socklen_t clientlen = sizeof(clientaddr);
                     int connfd;
                     // read ALL clients, otherwise error may occur 
                     while ((connfd = accept(para->listenfd, (SA*)&clientaddr, &clientlen)) > 0) {
+						std::shared_ptr<Connection> conn = std::make_shared<Connection>(connfd, para->limits->max_frame);
+						if (!para->table->publish(connfd, conn, para->limits->max_conns)) {	// full, reject early
+							para->stats->rejected();
+							close(connfd);
+							continue;
+						}
+						para->stats->accepted();
                         setnonblock(connfd);
-                        addfd(para->epfd, connfd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+                        setnodelay(connfd);
+						conn->deadline = TimerWheel<Connection>::now() + para->limits->idle_timeout;
+						if (para->limits->idle_timeout) {
+							para->wheel->schedule(conn);
+						}
+                        addfd(para->epfd, connfd, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT | EPOLLET, conn->gen);
                         //std::cout << "Server connected to " << inet_ntoa(clientaddr.sin_addr) << std::endl;
-						(*para->table)[connfd] = new Processor(connfd);
+						handle(conn, para->table, para->db, para->pool, para->limits, para->stats, para->slow);
                     }
-                } else if (sockfd > 0 && (event.events & EPOLLIN)) {
-					Processor* proc = (*para->table)[sockfd];
-					int read_bytes;
-					string res;
-
-					if ((read_bytes = proc->read()) < 0) {
-						//delete proc;
-						//para->table->erase(sockfd);
-					} else if (read_bytes == 0) {
-						//delete proc;
-						//para->table->erase(sockfd);
-						//log("Client quited\n");
-						//continue;
-					} else {
-						//std::cout << "Received " << read_bytes << " bytes" << std::endl;
-					}
-					while (proc->ready()) {
-						res = para->db->exec(proc->request());
-						if (proc->response(res) < 0) {
-							delete proc;
-							para->table->erase(sockfd);
-						}
+                } else if (sockfd > 0) {	// wake the coroutine serving it
+					Connection* conn = para->table->lookup(sockfd, (uint32_t)(event.data.u64 >> 32));
+					if (conn) {
+						conn->readiness.notify(event.events);
 					}
 				}
             } else {
@@ -218,3 +420,212 @@ void* serve(void *arg) {
     return nullptr;
 }
 
+
+/**
+ * A minimal HTTP/1.1 responder on its own blocking thread: one request per
+ * connection, GET /metrics gets the Prometheus exposition, anything else a
+ * 404. Timeouts keep a stuck scraper from holding the thread.
+ */
+void* admin(void* arg) {
+	Admin* para = (Admin*)arg;
+	timeval timeout = { 5, 0 };
+	char buf[BUFSIZE];
+
+	while (true) {
+		int fd = accept(para->listenfd, nullptr, nullptr);
+		if (fd < 0) {
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		string req, status = "200 OK", body;
+		ssize_t n;
+		while (req.find("\r\n\r\n") == string::npos && req.size() < BUFSIZE && (n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+			req.append(buf, n);
+		}
+		if (req.compare(0, 12, "GET /metrics") == 0 && (req[12] == ' ' || req[12] == '?')) {
+			body = para->stats->metrics(para->table->count(), *para->db);
+		} else {
+			status = "404 Not Found";
+			body = "only /metrics is served here\n";
+		}
+
+		string res = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+			+ std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+		const char* ptr = res.c_str();
+		size_t left = res.size();
+		while (left > 0 && (n = send(fd, ptr, left, 0)) > 0) {
+			ptr += n;
+			left -= n;
+		}
+		close(fd);
+	}
+	return nullptr;
+}
+
+/**
+ * Flag connections idle past their deadline and wake their coroutines,
+ * which close them. The fd is left to the coroutine, so it is never
+ * touched after a new connection may have taken its number.
+ */
+void reap(TimerWheel<Connection>& wheel, Stats& stats) {
+	std::vector<std::shared_ptr<Connection>> expired;
+
+	wheel.advance(TimerWheel<Connection>::now(), expired);
+	for (auto& conn : expired) {
+		stats.reaped();
+		conn->expired = true;
+		conn->readiness.notify(EPOLLIN | EPOLLOUT);
+	}
+}
+
+/**
+ * Serve a connection in a straight line: read requests, run them in order
+ * and reply. Reads served from memory are answered right here; anything
+ * else is offloaded to the work-stealing execution stage, where the
+ * coroutine resumes, so event loop threads never wait on disk or on engine
+ * locks. It suspends whenever the socket has nothing to read or no room
+ * to write, and ends with the connection. Every request is timed from
+ * parse to the last byte handed to the socket, stage by stage for the
+ * slow log.
+ */
+Task handle(std::shared_ptr<Connection> conn, Table* table, DB* db, ThreadPool* pool, Limits* limits, Stats* stats, SlowLog* slow) {
+	Processor& proc = conn->proc;
+	int fd = proc.fd();
+	string res;
+
+	while (true) {
+		uint64_t reading = Stats::now();
+		proc.read();
+		uint64_t read_ns = Stats::now() - reading;
+		conn->deadline = TimerWheel<Connection>::now() + limits->idle_timeout;
+		while (!proc.closed() && proc.ready()) {
+			std::string_view req = proc.request();		// into the read buffer, which stays put until the next read
+			FileRange range;
+			cmd_t cmd = Stats::command(req);
+			Span span;
+			span.ns[SPAN_READ] = read_ns;
+			span.sampled = slow->sample();
+			uint64_t start = Stats::now();
+
+			if (cmd == CMD_STATS) {		// stats every file of the database, keep it off the event loop
+				Offload job = { pool, ThreadPool::BULK, [&]() { res = stats->report(table->count(), *db); } };
+				co_await job;
+			} else {
+				Trace::current = span.sampled ? &span.engine : nullptr;		// only while this thread runs it
+				bool served = db->tryExec(req, res);
+				Trace::current = nullptr;
+				if (!served) {
+					Offload job = { pool, DB::readOnly(req) ? ThreadPool::URGENT : ThreadPool::BULK,	// reads overtake queued writes
+						[&]() {
+							span.ns[SPAN_QUEUE] = Stats::now() - start;
+							Trace::current = span.sampled ? &span.engine : nullptr;
+							res = db->exec(req, range);
+							Trace::current = nullptr;
+						} };
+					co_await job;
+				}
+			}
+			if (cmd == CMD_UPLOAD && res.compare(0, 7, "upload ") == 0) {
+				if (conn->uploads.size() >= OPENUPLOADS) {
+					std::erase_if(conn->uploads, [db](uint64_t token) { return !db->uploading(token); });
+				}
+				conn->uploads.push_back(strtoull(res.c_str() + 7, nullptr, 10));
+			}
+			uint64_t sending = Stats::now();
+			span.ns[SPAN_EXEC] = sending - start - span.ns[SPAN_QUEUE];
+
+			uint32_t size = range.fd < 0 ? res.size() : range.length;
+			bool sent = co_await sendAll(conn.get(), (char*)&size, sizeof(size), MSG_MORE);
+			if (sent && range.fd < 0) {
+				sent = co_await sendAll(conn.get(), res.c_str(), res.size(), 0);
+			} else if (sent) {
+				sent = co_await sendFile(conn.get(), range.fd, range.offset, range.length);
+			}
+			if (range.fd >= 0) {
+				close(range.fd);
+			}
+			if (!sent) {
+				proc.disconnect();
+			}
+			uint64_t end = Stats::now();
+			span.ns[SPAN_SEND] = end - sending;
+			stats->request(cmd, end - start, req.size() + sizeof(size), size + sizeof(size));
+			slow->check(req, end - start, span);
+			conn->deadline = TimerWheel<Connection>::now() + limits->idle_timeout;
+		}
+		if (!proc.closed() && proc.oversized()) {	// never buffered whole, the stream cannot go on past it
+			Status s;
+			res = s.InvalidArgument("Request is over the limit of " + std::to_string(limits->max_frame) + " bytes.").toString();
+			uint32_t size = res.size();
+			if (co_await sendAll(conn.get(), (char*)&size, sizeof(size), MSG_MORE)) {
+				co_await sendAll(conn.get(), res.c_str(), res.size(), 0);
+			}
+			proc.disconnect();
+		}
+		if (proc.closed()) {
+			break;
+		}
+		if (!proc.drained()) {		// stopped at max_frame, the socket has more
+			continue;
+		}
+		co_await conn->readiness.wait(EPOLLIN);
+		if (conn->expired) {
+			proc.disconnect();
+			break;
+		}
+	}
+
+	// a client gone mid upload would hold its fd and block merge for good
+	for (uint64_t token : conn->uploads) {
+		db->abortUpload(token);
+	}
+	// the fd may be taken by a new connection already, retire leaves that one alone
+	table->retire(fd, conn);
+}
+
+Async<bool> sendAll(Connection* conn, const char* ptr, size_t left, int flags) {
+	int fd = conn->proc.fd();
+
+	while (left > 0) {
+		ssize_t nwrite = send(fd, ptr, left, flags);
+		if (nwrite < 0 && errno == EAGAIN) {
+			co_await conn->readiness.wait(EPOLLOUT);
+			if (conn->expired) {	// the peer stopped reading
+				co_return false;
+			}
+			continue;
+		}
+		if (nwrite <= 0) {
+			co_return false;
+		}
+		left -= nwrite;
+		ptr += nwrite;
+	}
+	co_return true;
+}
+
+/**
+ * the value goes from the page cache to the socket without being copied
+ * through user space
+ */
+Async<bool> sendFile(Connection* conn, int fd, off_t offset, size_t left) {
+	int sockfd = conn->proc.fd();
+
+	while (left > 0) {
+		ssize_t nwrite = sendfile(sockfd, fd, &offset, left);
+		if (nwrite < 0 && errno == EAGAIN) {
+			co_await conn->readiness.wait(EPOLLOUT);
+			if (conn->expired) {
+				co_return false;
+			}
+			continue;
+		}
+		if (nwrite <= 0) {
+			co_return false;
+		}
+		left -= nwrite;
+	}
+	co_return true;
+}
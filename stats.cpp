@@ -0,0 +1,304 @@
+/**
+ * File: stats.cpp
+ */
+
+#include "stats.h"
+#include <time.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+const char* CmdNames[CMDS] = {
+	"get", "set", "del", "batch", "gets", "incrby", "append", "cas",
+	"getifmodified", "upload", "chunk", "abort", "getrange", "strlen", "stats",
+	"other"
+};
+
+const char* SpanNames[SPANS] = { "read", "queue", "exec", "send" };
+const char* StageNames[STAGES] = { "index_lock", "cache_lock", "disk_lock", "disk_read", "disk_write" };
+
+static size_t bucket(uint64_t ns) {		// log-linear, as Histogram in press
+	if (ns < (1ULL << SUBBUCKETS)) {
+		return (size_t)ns;
+	}
+	int shift = 63 - __builtin_clzll(ns) - SUBBUCKETS;
+	return ((size_t)(shift + 1) << SUBBUCKETS) + (size_t)((ns >> shift) - (1ULL << SUBBUCKETS));
+}
+
+static uint64_t highest(size_t bucket) {
+	if (bucket < (1ULL << SUBBUCKETS)) {
+		return bucket;
+	}
+	int shift = (int)(bucket >> SUBBUCKETS) - 1;
+	uint64_t sub = (bucket & ((1ULL << SUBBUCKETS) - 1)) + (1ULL << SUBBUCKETS);
+	return ((sub + 1) << shift) - 1;
+}
+
+uint64_t Totals::percentile(int cmd, double p) const {
+	uint64_t rank = (uint64_t)ceil(p / 100 * requests[cmd]), seen = 0;
+	rank = rank < 1 ? 1 : rank;
+	for (size_t i = 0; i < LATENCYBUCKETS; ++i) {
+		seen += latency[cmd][i];
+		if (seen >= rank) {
+			return highest(i);
+		}
+	}
+	return 0;
+}
+
+uint64_t Totals::below(int cmd, uint64_t ns) const {
+	uint64_t count = 0;
+	for (size_t i = 0; i < LATENCYBUCKETS && highest(i) <= ns; ++i) {
+		count += latency[cmd][i];
+	}
+	return count;
+}
+
+
+Stats::Stats() : shards(new Counters[SHARDS]()), next(0), started(now()) {}
+
+uint64_t Stats::now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+Counters& Stats::local() {
+	thread_local Counters* mine = nullptr;
+	if (!mine) {
+		mine = &shards[next.fetch_add(1, std::memory_order_relaxed) % SHARDS];
+	}
+	return *mine;
+}
+
+cmd_t Stats::command(std::string_view req) {
+	size_t end = req.find(' ');
+	size_t len = end == std::string_view::npos ? req.size() : end;
+	for (int i = 0; i < CMD_OTHER; ++i) {
+		if (req.compare(0, len, CmdNames[i]) == 0) {
+			return (cmd_t)i;
+		}
+	}
+	return req.compare(0, len, "STATS") == 0 ? CMD_STATS : CMD_OTHER;
+}
+
+void Stats::request(cmd_t cmd, uint64_t ns, uint64_t in, uint64_t out) {
+	Counters& c = local();
+	add(c.requests[cmd], 1);
+	add(c.latency_ns[cmd], ns);
+	add(c.latency[cmd][bucket(ns)], 1);
+	add(c.bytes_in, in);
+	add(c.bytes_out, out);
+}
+
+void Stats::collect(Totals& totals) {
+	memset(&totals, 0, sizeof(totals));
+	for (int s = 0; s < SHARDS; ++s) {
+		Counters& c = shards[s];
+		for (int i = 0; i < CMDS; ++i) {
+			totals.requests[i] += c.requests[i].load(std::memory_order_relaxed);
+			totals.latency_ns[i] += c.latency_ns[i].load(std::memory_order_relaxed);
+			for (int b = 0; b < LATENCYBUCKETS; ++b) {
+				totals.latency[i][b] += c.latency[i][b].load(std::memory_order_relaxed);
+			}
+		}
+		totals.bytes_in += c.bytes_in.load(std::memory_order_relaxed);
+		totals.bytes_out += c.bytes_out.load(std::memory_order_relaxed);
+		totals.accepted += c.accepted.load(std::memory_order_relaxed);
+		totals.rejected += c.rejected.load(std::memory_order_relaxed);
+		totals.reaped += c.reaped.load(std::memory_order_relaxed);
+	}
+}
+
+static uint64_t residentBytes() {
+	uint64_t pages = 0, resident = 0;
+	std::ifstream statm("/proc/self/statm");
+	statm >> pages >> resident;
+	return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+string Stats::report(uint32_t conns, DB& db) {
+	Totals* totals = new Totals();		// too large for a coroutine's stack
+	DBStats st;
+	std::stringstream ss;
+	uint64_t requests = 0;
+
+	collect(*totals);
+	db.stats(st);
+	for (int i = 0; i < CMDS; ++i) {
+		requests += totals->requests[i];
+	}
+
+	ss << std::fixed << std::setprecision(1);
+	ss << "uptime_seconds " << uptime() << "\n"
+	   << "connections " << conns << "\n"
+	   << "connections_accepted " << totals->accepted << "\n"
+	   << "connections_rejected " << totals->rejected << "\n"
+	   << "connections_reaped " << totals->reaped << "\n"
+	   << "requests " << requests << "\n"
+	   << "bytes_in " << totals->bytes_in << "\n"
+	   << "bytes_out " << totals->bytes_out << "\n"
+	   << "keys " << st.keys << "\n"
+	   << "cache_hits " << st.cache_hits << "\n"
+	   << "cache_misses " << st.cache_misses << "\n"
+	   << "cache_hit_ratio " << std::setprecision(3)
+	   << (st.cache_hits + st.cache_misses ? (double)st.cache_hits / (st.cache_hits + st.cache_misses) : 0) << "\n"
+	   << std::setprecision(1)
+	   << "memory_rss_bytes " << residentBytes() << "\n"
+	   << "keydir_bytes " << st.keydir_bytes << "\n"
+	   << "keydir_longest_chain " << st.keydir_chain << "\n"
+	   << "data_files " << st.data_files << "\n"
+	   << "data_bytes " << st.data_bytes << "\n"
+	   << "hint_files " << st.hint_files << "\n"
+	   << "hint_bytes " << st.hint_bytes << "\n"
+	   << "disk_lock_waits " << st.disk_waits << "\n"
+	   << "disk_lock_wait_us " << st.disk_wait_ns / 1000 << "\n"
+	   << "merges " << st.merges << "\n"
+	   << "merge_running " << st.merging << "\n"
+	   << "merge_moved " << st.merge_moved << "\n";
+	for (int i = 0; i < CMDS; ++i) {
+		if (totals->requests[i] == 0) {
+			continue;
+		}
+		ss << "cmd_" << CmdNames[i] << " " << totals->requests[i]
+		   << " mean_us=" << (double)totals->latency_ns[i] / totals->requests[i] / 1000
+		   << " p50_us=" << totals->percentile(i, 50) / 1000.0
+		   << " p90_us=" << totals->percentile(i, 90) / 1000.0
+		   << " p99_us=" << totals->percentile(i, 99) / 1000.0
+		   << " p99.9_us=" << totals->percentile(i, 99.9) / 1000.0
+		   << " max_us=" << totals->percentile(i, 100) / 1000.0 << "\n";
+	}
+	delete totals;
+
+	string res = ss.str();
+	res.pop_back();		// no trailing newline, like every other reply
+	return res;
+}
+
+/**
+ * the same numbers for a Prometheus scrape. Latency buckets are folded
+ * into fixed bounds, each bound counting the fine buckets that end at or
+ * below it, so a bound may miss up to an eighth of its own value.
+ */
+string Stats::metrics(uint32_t conns, DB& db) {
+	static const struct { const char* le; uint64_t ns; } bounds[] = {
+		{ "0.00005", 50000 }, { "0.0001", 100000 }, { "0.00025", 250000 }, { "0.0005", 500000 },
+		{ "0.001", 1000000 }, { "0.0025", 2500000 }, { "0.005", 5000000 }, { "0.01", 10000000 },
+		{ "0.025", 25000000 }, { "0.05", 50000000 }, { "0.1", 100000000 }, { "0.25", 250000000 },
+		{ "0.5", 500000000 }, { "1", 1000000000 }, { "2.5", 2500000000 } };
+	Totals* totals = new Totals();
+	DBStats st;
+	std::stringstream ss;
+
+	collect(*totals);
+	db.stats(st);
+
+	auto metric = [&](const char* name, const char* type, const char* help) {
+		ss << "# HELP kv_" << name << " " << help << "\n# TYPE kv_" << name << " " << type << "\n";
+	};
+	auto value = [&](const char* name, const char* type, const char* help, uint64_t v) {
+		metric(name, type, help);
+		ss << "kv_" << name << " " << v << "\n";
+	};
+	auto seconds = [&](uint64_t ns) -> std::stringstream& {		// fixed point, never exponent notation
+		ss << ns / 1000000000 << "." << std::setw(9) << std::setfill('0') << ns % 1000000000 << std::setfill(' ');
+		return ss;
+	};
+
+	value("uptime_seconds", "gauge", "Seconds since the server started.", uptime());
+	value("connections", "gauge", "Open client connections.", conns);
+	value("connections_accepted_total", "counter", "Connections accepted.", totals->accepted);
+	value("connections_rejected_total", "counter", "Connections closed at once, over the limit.", totals->rejected);
+	value("connections_reaped_total", "counter", "Connections closed for being idle.", totals->reaped);
+	value("received_bytes_total", "counter", "Request bytes received, framing included.", totals->bytes_in);
+	value("sent_bytes_total", "counter", "Reply bytes sent, framing included.", totals->bytes_out);
+	value("keys", "gauge", "Live keys in the index.", st.keys);
+	value("cache_hits_total", "counter", "Reads answered by the value cache.", st.cache_hits);
+	value("cache_misses_total", "counter", "Reads the value cache could not answer.", st.cache_misses);
+	value("memory_rss_bytes", "gauge", "Resident memory of the process.", residentBytes());
+	value("keydir_bytes", "gauge", "Size of the disk resident keydir.", st.keydir_bytes);
+	value("keydir_longest_chain", "gauge", "Pages in the longest chain of the disk keydir.", st.keydir_chain);
+	value("data_files", "gauge", "Data files on disk.", st.data_files);
+	value("data_bytes", "gauge", "Size of the data files.", st.data_bytes);
+	value("hint_files", "gauge", "Hint files on disk.", st.hint_files);
+	value("hint_bytes", "gauge", "Size of the hint files.", st.hint_bytes);
+	value("disk_lock_waits_total", "counter", "Disk lock acquisitions that had to wait.", st.disk_waits);
+	metric("disk_lock_wait_seconds_total", "counter", "Time spent waiting for the disk lock.");
+	ss << "kv_disk_lock_wait_seconds_total ";
+	seconds(st.disk_wait_ns) << "\n";
+	value("merges_total", "counter", "Merges completed.", st.merges);
+	value("merge_running", "gauge", "1 while a merge copies live records.", st.merging);
+	value("merge_moved_records", "gauge", "Records copied by the running or last merge.", st.merge_moved);
+
+	metric("requests_total", "counter", "Requests served, by command.");
+	for (int i = 0; i < CMDS; ++i) {
+		ss << "kv_requests_total{cmd=\"" << CmdNames[i] << "\"} " << totals->requests[i] << "\n";
+	}
+	metric("request_duration_seconds", "histogram", "From parsing a request to the last byte of its reply.");
+	for (int i = 0; i < CMDS; ++i) {
+		uint64_t count = totals->below(i, UINT64_MAX);		// from the buckets, so +Inf never sits below a bucket
+		if (count == 0) {
+			continue;
+		}
+		for (auto& bound : bounds) {
+			ss << "kv_request_duration_seconds_bucket{cmd=\"" << CmdNames[i] << "\",le=\"" << bound.le << "\"} "
+			   << totals->below(i, bound.ns) << "\n";
+		}
+		ss << "kv_request_duration_seconds_bucket{cmd=\"" << CmdNames[i] << "\",le=\"+Inf\"} " << count << "\n";
+		ss << "kv_request_duration_seconds_sum{cmd=\"" << CmdNames[i] << "\"} ";
+		seconds(totals->latency_ns[i]) << "\n";
+		ss << "kv_request_duration_seconds_count{cmd=\"" << CmdNames[i] << "\"} " << count << "\n";
+	}
+	delete totals;
+
+	return ss.str();
+}
+
+
+/** SlowLog **/
+
+SlowLog::SlowLog(uint32_t threshold_us, uint32_t sample) : threshold((uint64_t)threshold_us * 1000), every(sample) {
+	_lock = PTHREAD_MUTEX_INITIALIZER;
+}
+
+bool SlowLog::sample() {
+	thread_local uint32_t served = 0;		// roughly one in every, with no shared counter
+	return enabled() && every > 0 && ++served % every == 0;
+}
+
+void SlowLog::check(std::string_view req, uint64_t total, const Span& span) {
+	if (!enabled() || total < threshold) {
+		return;
+	}
+
+	char when[32];
+	struct tm tm;
+	time_t now = time(nullptr);
+	strftime(when, sizeof(when), "%F %T", localtime_r(&now, &tm));
+	string shown(req.substr(0, 64));		// values may be long or binary
+	for (auto& ch : shown) {
+		ch = isprint((unsigned char)ch) ? ch : '.';
+	}
+
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(3);
+	ss << "[slow] " << when << " " << total / 1e6 << "ms \"" << shown << (req.size() > 64 ? "...\"" : "\"");
+	for (int i = 0; i < SPANS; ++i) {
+		ss << " " << SpanNames[i] << "=" << span.ns[i] / 1e6;
+		if (i == SPAN_EXEC && span.sampled) {
+			ss << " (";
+			for (int j = 0; j < STAGES; ++j) {
+				ss << (j ? " " : "") << StageNames[j] << "=" << span.engine.ns[j] / 1e6;
+			}
+			ss << ")";
+		}
+	}
+	ss << "\n";
+
+	pthread_mutex_lock(&_lock);
+	std::cerr << ss.str() << std::flush;
+	pthread_mutex_unlock(&_lock);
+}
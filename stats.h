@@ -0,0 +1,119 @@
+/**
+ * File: stats.h
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+#include "kv.h"
+
+#define SHARDS 16			// threads beyond this share shards, still without locks
+#define SUBBUCKETS 3		// 8 latency buckets per power of two, within 12.5%
+#define LATENCYBUCKETS ((64 - SUBBUCKETS + 1) << SUBBUCKETS)
+
+enum cmd_t {
+	CMD_GET = 0, CMD_SET, CMD_DEL, CMD_BATCH, CMD_GETS, CMD_INCRBY, CMD_APPEND, CMD_CAS,
+	CMD_GETIFMODIFIED, CMD_UPLOAD, CMD_CHUNK, CMD_ABORT, CMD_GETRANGE, CMD_STRLEN, CMD_STATS,
+	CMD_OTHER, CMDS
+};
+
+extern const char* CmdNames[CMDS];
+
+enum span_t { SPAN_READ = 0, SPAN_QUEUE, SPAN_EXEC, SPAN_SEND, SPANS };
+
+extern const char* SpanNames[SPANS];
+extern const char* StageNames[STAGES];
+
+
+/** counters of one shard, a thread only ever adds to its own **/
+
+struct alignas(64) Counters {
+	std::atomic<uint64_t> requests[CMDS];
+	std::atomic<uint64_t> latency_ns[CMDS];		// sum
+	std::atomic<uint64_t> latency[CMDS][LATENCYBUCKETS];
+	std::atomic<uint64_t> bytes_in, bytes_out;
+	std::atomic<uint64_t> accepted, rejected, reaped;
+};
+
+struct Totals {		// all shards added up
+	uint64_t requests[CMDS];
+	uint64_t latency_ns[CMDS];
+	uint64_t latency[CMDS][LATENCYBUCKETS];
+	uint64_t bytes_in, bytes_out;
+	uint64_t accepted, rejected, reaped;
+
+	uint64_t percentile(int cmd, double p) const;	// ns, highest value of its bucket
+	uint64_t below(int cmd, uint64_t ns) const;		// requests in buckets ending at or before ns
+};
+
+
+/**
+ * Stats
+ *
+ * runtime counters of the server. Each thread picks a shard the first
+ * time it counts something and adds to it with relaxed atomics, so a
+ * request costs a few uncontended increments and two clock reads.
+ * Shards are only added up when somebody asks.
+ */
+
+class Stats {
+public:
+	Stats();
+	static cmd_t command(std::string_view req);	// by the first word
+	static uint64_t now();		// ns, monotonic
+	void request(cmd_t cmd, uint64_t ns, uint64_t in, uint64_t out);
+	void accepted() { add(local().accepted, 1); }
+	void rejected() { add(local().rejected, 1); }
+	void reaped() { add(local().reaped, 1); }
+	void collect(Totals& totals);
+	string report(uint32_t conns, DB& db);		// the reply to STATS
+	string metrics(uint32_t conns, DB& db);		// Prometheus text exposition
+	uint64_t uptime() { return (now() - started) / 1000000000; }
+private:
+	Counters* shards;
+	std::atomic<uint32_t> next;
+	uint64_t started;
+
+	Counters& local();
+	static void add(std::atomic<uint64_t>& counter, uint64_t n) { counter.fetch_add(n, std::memory_order_relaxed); }
+};
+
+
+/** where one request spent its time in the server, engine only when sampled **/
+
+struct Span {
+	uint64_t ns[SPANS];		// read is of the whole batch the request came in
+	Trace engine;
+	bool sampled;
+
+	Span() : ns{ 0 }, sampled(false) {}
+};
+
+/**
+ * SlowLog
+ *
+ * requests slower than the threshold are written to stderr with the time
+ * of each stage. The server stages cost a few clock reads and are always
+ * taken; tracing inside the engine reads the clock around every lock wait
+ * and disk access, so only one request in every sample is traced there.
+ */
+
+class SlowLog {
+public:
+	SlowLog(uint32_t threshold_us, uint32_t sample);
+	bool enabled() { return threshold > 0; }
+	bool sample();		// trace the next request through the engine
+	void check(std::string_view req, uint64_t total, const Span& span);	// log it if slow
+private:
+	uint64_t threshold;		// ns, 0 disables
+	uint32_t every;
+	pthread_mutex_t _lock;		// one line at a time
+};
+
+
+#endif
@@ -1,4 +1,5 @@
 #include "tcp.h"
+#include <netinet/tcp.h>
 
 int open_clientfd(char *name, int port) {
     int clientfd;
@@ -60,3 +61,8 @@ int open_listenfd(int port) {
     }
     return listenfd;
 }
+
+int setnodelay(int fd) {
+    int optval = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&optval, sizeof(int));
+}
@@ -21,4 +21,6 @@ int open_clientfd(char *name, int port);
 
 int open_listenfd(int port);
 
+int setnodelay(int fd);     // send small replies at once instead of waiting on Nagle
+
 #endif
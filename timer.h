@@ -0,0 +1,68 @@
+/**
+ * File: timer.h
+ *
+ * A hashed timer wheel with one second ticks. Items carry their own
+ * deadline, which activity simply moves forward; the wheel only looks at
+ * it when the slot the item sits in comes round, and then either expires
+ * the item or rehashes it to the slot of its new deadline. Touching an
+ * item and expiring it are both O(1).
+ */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <pthread.h>
+#include <ctime>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+template <typename T>
+class TimerWheel {		// T has an atomic<uint64_t> deadline, in ticks
+public:
+	TimerWheel(uint32_t n) : slots(n), current(now()) { _lock = PTHREAD_MUTEX_INITIALIZER; }
+
+	static uint64_t now() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec;
+	}
+
+	void schedule(const std::shared_ptr<T>& item) {
+		pthread_mutex_lock(&_lock);
+		slots[item->deadline % slots.size()].push_back(item);
+		pthread_mutex_unlock(&_lock);
+	}
+
+	// items past their deadline as of t, gone ones are dropped on the way
+	void advance(uint64_t t, std::vector<std::shared_ptr<T>>& expired) {
+		pthread_mutex_lock(&_lock);
+		uint64_t steps = t > current ? std::min(t - current, (uint64_t)slots.size()) : 0;
+		for (uint64_t i = 1; i <= steps; ++i) {
+			std::vector<std::weak_ptr<T>> due;
+			due.swap(slots[(current + i) % slots.size()]);
+			for (auto& w : due) {
+				std::shared_ptr<T> item = w.lock();
+				if (!item) {
+					continue;
+				}
+				uint64_t deadline = item->deadline;
+				if (deadline <= t) {
+					expired.push_back(item);
+				} else {
+					slots[deadline % slots.size()].push_back(w);
+				}
+			}
+		}
+		current = std::max(current, t);
+		pthread_mutex_unlock(&_lock);
+	}
+private:
+	pthread_mutex_t _lock;
+	std::vector<std::vector<std::weak_ptr<T>>> slots;
+	uint64_t current;
+};
+
+
+#endif
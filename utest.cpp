@@ -9,7 +9,7 @@ using namespace std;
 
 int main(int argc, char* argv[]) {
 	if (argc != 2) {
-		cout << "Usage: " << argv[0] << " < debug / ui / con >" << std::endl;
+		cout << "Usage: " << argv[0] << " < debug / ui / con / batch / rmw / snap / disk / roll / lz / stream / stats >" << std::endl;
 		exit(1);
 	}
 	
@@ -21,6 +21,22 @@ int main(int argc, char* argv[]) {
 		debugger.ui();
 	} else if (!strcmp(argv[1], "con")) { 
 		debugger.test_concurrency();
+	} else if (!strcmp(argv[1], "batch")) {
+		debugger.test_batch();
+	} else if (!strcmp(argv[1], "rmw")) {
+		debugger.test_rmw();
+	} else if (!strcmp(argv[1], "snap")) {
+		debugger.test_snapshot();
+	} else if (!strcmp(argv[1], "disk")) {
+		debugger.test_disk_index();
+	} else if (!strcmp(argv[1], "roll")) {
+		debugger.test_rollover();
+	} else if (!strcmp(argv[1], "lz")) {
+		debugger.test_compression();
+	} else if (!strcmp(argv[1], "stream")) {
+		debugger.test_stream();
+	} else if (!strcmp(argv[1], "stats")) {
+		debugger.test_stats();
 	} else {
 		cout << "invalid option: " << argv[1] << endl;
 	}
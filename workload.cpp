@@ -0,0 +1,269 @@
+/**
+ * File: workload.cpp
+ */
+
+#include "workload.h"
+#include <cmath>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+const char* OpNames[OPS] = { "read", "update", "insert", "scan", "rmw" };
+const char* DistNames[3] = { "uniform", "zipfian", "latest" };
+
+static uint64_t fnv(uint64_t v) {	// FNV-1a over the bytes of v
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (int i = 0; i < 8; ++i) {
+		h ^= v & 0xff;
+		h *= 1099511628211ULL;
+		v >>= 8;
+	}
+	return h;
+}
+
+
+/** Zipfian **/
+
+double Zipfian::pow2() {
+	return pow(2.0, theta);
+}
+
+void Zipfian::extend(uint64_t n) {
+	if (n < counted) {
+		zetan = 0;
+		counted = 0;
+	}
+	for (uint64_t i = counted; i < n; ++i) {
+		zetan += 1 / pow((double)(i + 1), theta);
+	}
+	counted = n;
+}
+
+uint64_t Zipfian::next(uint64_t n, double u) {
+	if (n <= 1) {
+		return 0;
+	}
+	if (n != counted) {
+		extend(n);
+	}
+
+	double uz = u * zetan;
+	if (uz < 1) {
+		return 0;
+	}
+	if (uz < 1 + pow(0.5, theta)) {
+		return 1;
+	}
+	double alpha = 1 / (1 - theta);
+	double eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+	uint64_t rank = (uint64_t)(n * pow(eta * u - eta + 1, alpha));
+	return rank < n ? rank : n - 1;
+}
+
+
+/** Workload **/
+
+Workload::Workload() : dist(ZIPFIAN), records(100000), max_scan(100), size_dist(UNIFORM), min_size(100), max_size(100) {
+	preset("a");
+}
+
+bool Workload::preset(const string& name) {
+	double mixes[6][OPS] = {
+		{ 0.50, 0.50, 0, 0, 0 },		// a: update heavy
+		{ 0.95, 0.05, 0, 0, 0 },		// b: read mostly
+		{ 1.00, 0, 0, 0, 0 },			// c: read only
+		{ 0.95, 0, 0.05, 0, 0 },		// d: read latest
+		{ 0, 0, 0.05, 0.95, 0 },		// e: short scans
+		{ 0.50, 0, 0, 0, 0.50 },		// f: read-modify-write
+	};
+
+	if (name.size() != 1 || tolower(name[0]) < 'a' || tolower(name[0]) > 'f') {
+		return false;
+	}
+	int n = tolower(name[0]) - 'a';
+	for (int i = 0; i < OPS; ++i) {
+		mix[i] = mixes[n][i];
+	}
+	dist = (n == 3) ? LATEST : ZIPFIAN;
+	return true;
+}
+
+bool Workload::setMix(const string& spec) {
+	double parts[OPS] = { 0 }, total = 0;
+	std::stringstream ss(spec);
+	string item;
+
+	while (std::getline(ss, item, ',')) {
+		size_t eq = item.find('=');
+		int op = OPS;
+		for (int i = 0; i < OPS && eq != string::npos; ++i) {
+			if (item.compare(0, eq, OpNames[i]) == 0) {
+				op = i;
+			}
+		}
+		if (op == OPS) {
+			return false;
+		}
+		parts[op] = atof(item.c_str() + eq + 1);
+		if (parts[op] < 0) {
+			return false;
+		}
+		total += parts[op];
+	}
+	if (total <= 0) {
+		return false;
+	}
+	for (int i = 0; i < OPS; ++i) {
+		mix[i] = parts[i] / total;
+	}
+	return true;
+}
+
+bool Workload::setDist(const string& name) {
+	for (int i = 0; i < 3; ++i) {
+		if (name == DistNames[i]) {
+			dist = (dist_t)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Workload::setSize(const string& spec) {
+	string range = spec;
+	dist_t d = UNIFORM;
+	if (range.compare(0, 8, "zipfian:") == 0) {
+		d = ZIPFIAN;
+		range = range.substr(8);
+	}
+
+	size_t dash = range.find('-');
+	long lo = atol(range.c_str()), hi = (dash == string::npos) ? lo : atol(range.c_str() + dash + 1);
+	if (lo <= 0 || hi < lo || hi > (1 << 20)) {		// values travel in one request
+		return false;
+	}
+	size_dist = d;
+	min_size = (uint32_t)lo;
+	max_size = (uint32_t)hi;
+	return true;
+}
+
+string Workload::describe() const {
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(2);
+	for (int i = 0; i < OPS; ++i) {
+		if (mix[i] > 0) {
+			ss << OpNames[i] << " " << mix[i] << " ";
+		}
+	}
+	ss << "| " << DistNames[dist] << " keys over " << records << " records | values ";
+	if (min_size == max_size) {
+		ss << min_size;
+	} else {
+		ss << DistNames[size_dist] << " " << min_size << "-" << max_size;
+	}
+	ss << " bytes";
+	if (mix[SCAN] > 0) {
+		ss << " | scans up to " << max_scan;
+	}
+	return ss.str();
+}
+
+
+/** Generator **/
+
+Generator::Generator(const Workload& w, KeySpace* k, uint64_t seed)
+	: workload(w), keys(k), rng(seed), uniform(0.0, 1.0) {
+	pool.resize(w.max_size + 4096);
+	for (auto& ch : pool) {
+		ch = 'a' + rng() % 26;
+	}
+}
+
+string Generator::key(uint64_t n) {
+	return "user" + std::to_string(fnv(n));
+}
+
+uint64_t Generator::known() {
+	uint64_t n = keys->next.load(), pending = keys->pending.load();	// in this order, see next()
+	return n > pending ? n - pending : 0;
+}
+
+uint64_t Generator::pick() {
+	uint64_t n = known();
+	if (n == 0) {
+		return 0;
+	}
+	switch (workload.dist) {
+		case ZIPFIAN:		// scrambled, so the hot keys are spread over the space
+			return fnv(keyrank.next(n, uniform(rng))) % n;
+		case LATEST:
+			return n - 1 - keyrank.next(n, uniform(rng));
+		default:
+			return rng() % n;
+	}
+}
+
+string Generator::value() {
+	uint32_t span = workload.max_size - workload.min_size + 1, len;
+	if (workload.size_dist == ZIPFIAN) {
+		len = workload.min_size + (uint32_t)sizerank.next(span, uniform(rng));
+	} else {
+		len = workload.min_size + (uint32_t)(rng() % span);
+	}
+	return pool.substr(rng() % (pool.size() - len + 1), len);
+}
+
+void Generator::next(Op& op) {
+	double u = uniform(rng), sum = 0;
+	int type = 0;
+	while (type < OPS - 1 && (sum += workload.mix[type]) <= u) {
+		++type;
+	}
+	while (workload.mix[type] <= 0) {		// rounding ran past the last used op
+		--type;
+	}
+
+	op.type = (op_t)type;
+	op.requests.clear();
+	switch (op.type) {
+		case READ:
+			op.requests.push_back("get " + key(pick()));
+			break;
+		case UPDATE:
+			op.requests.push_back("set " + key(pick()) + " " + value());
+			break;
+		case INSERT:
+			++keys->pending;		// before the number shows, so readers never count it early
+			op.requests.push_back("set " + key(keys->next.fetch_add(1)) + " " + value());
+			break;
+		case SCAN: {		// no ordered scan on the server, fetch a run of key numbers instead
+			uint64_t first = pick(), n = std::max(known(), (uint64_t)1);
+			uint32_t len = 1 + (uint32_t)(rng() % workload.max_scan);
+			for (uint32_t i = 0; i < len; ++i) {
+				op.requests.push_back("get " + key((first + i) % n));
+			}
+			break;
+		}
+		case RMW: {
+			string k = key(pick());
+			op.requests.push_back("get " + k);
+			op.requests.push_back("set " + k + " " + value());
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void Generator::done(const Op& op) {
+	if (op.type == INSERT) {
+		--keys->pending;
+	}
+}
+
+void Generator::load(Op& op, uint64_t n) {
+	op.type = INSERT;
+	op.requests.clear();
+	op.requests.push_back("set " + key(n) + " " + value());
+}
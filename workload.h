@@ -0,0 +1,111 @@
+/**
+ * File: workload.h
+ */
+
+#ifndef WORKLOAD_H_
+#define WORKLOAD_H_
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <random>
+#include <cstdint>
+
+using std::string;
+using std::vector;
+
+enum op_t { READ = 0, UPDATE = 1, INSERT = 2, SCAN = 3, RMW = 4, OPS = 5 };
+enum dist_t { UNIFORM = 0, ZIPFIAN = 1, LATEST = 2 };
+
+extern const char* OpNames[OPS];
+extern const char* DistNames[3];
+
+
+/**
+ * Zipfian
+ *
+ * draws ranks below n, rank r with probability proportional to
+ * 1 / (r + 1)^theta, by the method of Gray et al. as YCSB does.
+ * n may grow between draws, zeta is then extended rather than redone.
+ */
+
+class Zipfian {
+public:
+	Zipfian(double t = 0.99) : theta(t), zetan(0), counted(0) { zeta2 = 1 + 1 / pow2(); }
+	uint64_t next(uint64_t n, double u);	// u uniform in [0, 1)
+private:
+	double theta, zeta2, zetan;
+	uint64_t counted;		// terms summed into zetan
+
+	double pow2();
+	void extend(uint64_t n);
+};
+
+
+/**
+ * Workload
+ *
+ * what a press run does: the mix of operations, how keys are picked
+ * from the key space and how long the values are. The presets are
+ * the YCSB core workloads A to F.
+ */
+
+struct Workload {
+	double mix[OPS];		// proportions, summing to 1
+	dist_t dist;
+	uint64_t records;		// keys loaded before the run
+	uint32_t max_scan;		// scan lengths are uniform in [1, max_scan]
+	dist_t size_dist;		// of value lengths, LATEST is not allowed
+	uint32_t min_size, max_size;
+
+	Workload();
+	bool preset(const string& name);		// a .. f
+	bool setMix(const string& spec);		// read=0.9,update=0.1
+	bool setDist(const string& name);		// uniform / zipfian / latest
+	bool setSize(const string& spec);		// 100, 16-1024 or zipfian:16-1024
+	string describe() const;
+};
+
+
+/**
+ * Generator
+ *
+ * turns a workload into requests, one per thread. Keys are numbered,
+ * number n is stored as "user" followed by a hash of n so that
+ * neighbours do not cluster. Inserts draw fresh numbers from a counter
+ * shared by all threads, reads and updates pick among the numbers given
+ * out so far, less those whose inserts are still in flight.
+ */
+
+struct KeySpace {
+	std::atomic<uint64_t> next;		// numbers below it have been given out
+	std::atomic<uint64_t> pending;	// inserts not answered yet
+};
+
+struct Op {
+	op_t type;
+	vector<string> requests;	// sent back to back, one reply each
+};
+
+class Generator {
+public:
+	Generator(const Workload& w, KeySpace* keys, uint64_t seed);
+	void next(Op& op);				// an operation of the run
+	void done(const Op& op);		// its replies are all in
+	void load(Op& op, uint64_t n);	// the insert of key n in the load phase
+	static string key(uint64_t n);
+private:
+	const Workload& workload;
+	KeySpace* keys;
+	std::mt19937_64 rng;
+	std::uniform_real_distribution<double> uniform;
+	Zipfian keyrank, sizerank;
+	string pool;		// values are slices of it
+
+	uint64_t pick();
+	uint64_t known();		// key numbers below it exist on the server
+	string value();
+};
+
+
+#endif